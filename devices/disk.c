@@ -84,7 +84,7 @@ static void reset_channel (struct channel *);
 static bool check_device_type (struct disk *);
 static void identify_ata_device (struct disk *);
 
-static void select_sector (struct disk *, disk_sector_t);
+static void select_sector (struct disk *, disk_sector_t, size_t sec_cnt);
 static void issue_pio_command (struct channel *, uint8_t command);
 static void input_sector (struct channel *, void *);
 static void output_sector (struct channel *, const void *);
@@ -216,7 +216,7 @@ disk_read (struct disk *d, disk_sector_t sec_no, void *buffer) {
 
 	c = d->channel;
 	lock_acquire (&c->lock);
-	select_sector (d, sec_no);
+	select_sector (d, sec_no, 1);
 	issue_pio_command (c, CMD_READ_SECTOR_RETRY);
 	sema_down (&c->completion_wait);
 	if (!wait_while_busy (d))
@@ -240,7 +240,7 @@ disk_write (struct disk *d, disk_sector_t sec_no, const void *buffer) {
 
 	c = d->channel;
 	lock_acquire (&c->lock);
-	select_sector (d, sec_no);
+	select_sector (d, sec_no, 1);
 	issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
 	if (!wait_while_busy (d))
 		PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
@@ -250,6 +250,78 @@ disk_write (struct disk *d, disk_sector_t sec_no, const void *buffer) {
 	lock_release (&c->lock);
 }
 
+/* Reads BUF_CNT * BUF_SECS consecutive sectors starting at SEC_NO
+   from disk D with a single READ SECTOR command.  The data is
+   scattered over BUFFERS: each of the BUF_CNT buffers receives
+   BUF_SECS sectors.  At most DISK_XFER_MAX sectors may be read
+   at once.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+void
+disk_read_multiple (struct disk *d, disk_sector_t sec_no,
+		void *buffers[], size_t buf_cnt, size_t buf_secs) {
+	struct channel *c;
+	size_t sec_cnt = buf_cnt * buf_secs;
+	size_t i;
+
+	ASSERT (d != NULL);
+	ASSERT (buffers != NULL);
+	ASSERT (sec_cnt > 0 && sec_cnt <= DISK_XFER_MAX);
+
+	c = d->channel;
+	lock_acquire (&c->lock);
+	select_sector (d, sec_no, sec_cnt);
+	issue_pio_command (c, CMD_READ_SECTOR_RETRY);
+	/* The drive raises an interrupt each time the next sector is
+	   ready in its buffer. */
+	for (i = 0; i < sec_cnt; i++) {
+		sema_down (&c->completion_wait);
+		if (!wait_while_busy (d))
+			PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name,
+					(disk_sector_t) (sec_no + i));
+		input_sector (c, (uint8_t *) buffers[i / buf_secs]
+				+ (i % buf_secs) * DISK_SECTOR_SIZE);
+	}
+	d->read_cnt += sec_cnt;
+	lock_release (&c->lock);
+}
+
+/* Writes BUF_CNT * BUF_SECS consecutive sectors starting at SEC_NO
+   to disk D with a single WRITE SECTOR command, gathering the
+   data from BUFFERS as disk_read_multiple() scatters it.  At most
+   DISK_XFER_MAX sectors may be written at once.  Returns after
+   the disk has acknowledged receiving all of the data.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+void
+disk_write_multiple (struct disk *d, disk_sector_t sec_no,
+		void *buffers[], size_t buf_cnt, size_t buf_secs) {
+	struct channel *c;
+	size_t sec_cnt = buf_cnt * buf_secs;
+	size_t i;
+
+	ASSERT (d != NULL);
+	ASSERT (buffers != NULL);
+	ASSERT (sec_cnt > 0 && sec_cnt <= DISK_XFER_MAX);
+
+	c = d->channel;
+	lock_acquire (&c->lock);
+	select_sector (d, sec_no, sec_cnt);
+	issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
+	/* The drive asks for each sector with DRQ and raises an
+	   interrupt once it has taken it. */
+	for (i = 0; i < sec_cnt; i++) {
+		if (!wait_while_busy (d))
+			PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name,
+					(disk_sector_t) (sec_no + i));
+		output_sector (c, (uint8_t *) buffers[i / buf_secs]
+				+ (i % buf_secs) * DISK_SECTOR_SIZE);
+		sema_down (&c->completion_wait);
+	}
+	d->write_cnt += sec_cnt;
+	lock_release (&c->lock);
+}
+
 /* Disk detection and identification. */
 
 static void print_ata_string (char *string, size_t size);
@@ -402,17 +474,19 @@ print_ata_string (char *string, size_t size) {
 }
 
 /* Selects device D, waiting for it to become ready, and then
-   writes SEC_NO to the disk's sector selection registers.  (We
-   use LBA mode.) */
+   writes SEC_NO and SEC_CNT to the disk's sector selection
+   registers.  (We use LBA mode.)  A count of DISK_XFER_MAX is
+   encoded as 0. */
 static void
-select_sector (struct disk *d, disk_sector_t sec_no) {
+select_sector (struct disk *d, disk_sector_t sec_no, size_t sec_cnt) {
 	struct channel *c = d->channel;
 
-	ASSERT (sec_no < d->capacity);
-	ASSERT (sec_no < (1UL << 28));
+	ASSERT (sec_cnt > 0 && sec_cnt <= DISK_XFER_MAX);
+	ASSERT (sec_no + sec_cnt <= d->capacity);
+	ASSERT (sec_no + sec_cnt <= (1UL << 28));
 
 	select_device_wait (d);
-	outb (reg_nsect (c), 1);
+	outb (reg_nsect (c), sec_cnt == DISK_XFER_MAX ? 0 : sec_cnt);
 	outb (reg_lbal (c), sec_no);
 	outb (reg_lbam (c), sec_no >> 8);
 	outb (reg_lbah (c), (sec_no >> 16));
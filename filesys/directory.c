@@ -5,6 +5,7 @@
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
 #include "threads/malloc.h"
+#include "threads/slab.h"
 #include "threads/thread.h"
 
 /* Creates a directory with space for ENTRY_CNT entries in the
@@ -26,19 +27,28 @@ dir_create (disk_sector_t sector, size_t entry_cnt, disk_sector_t parent_sector,
 	return success;
 }
 
+/* Cache of struct dir. */
+static struct kmem_cache *dir_slab;
+
+/* Initializes the directory module. */
+void
+dir_init (void) {
+	dir_slab = kmem_cache_create ("dir", sizeof (struct dir), NULL);
+}
+
 /* Opens and returns the directory for the given INODE, of which
  * it takes ownership.  Returns a null pointer on failure. */
 struct dir *
 dir_open (struct inode *inode) {
 	// printf("dir open start\n");
-	struct dir *dir = calloc (1, sizeof *dir);
+	struct dir *dir = kmem_cache_alloc (dir_slab);
 	if (inode != NULL && dir != NULL) {
 		dir->inode = inode;
 		dir->pos = 0;
 		return dir;
 	} else {
 		inode_close (inode);
-		free (dir);
+		kmem_cache_free (dir_slab, dir);
 		return NULL;
 	}
 }
@@ -62,7 +72,7 @@ void
 dir_close (struct dir *dir) {
 	if (dir != NULL) {
 		inode_close (dir->inode);
-		free (dir);
+		kmem_cache_free (dir_slab, dir);
 	}
 }
 
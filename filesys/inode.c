@@ -7,6 +7,10 @@
 #include "filesys/free-map.h"
 #include "filesys/fat.h"
 #include "threads/malloc.h"
+#include "threads/slab.h"
+#ifdef VM
+#include "filesys/page_cache.h"
+#endif
 
 /* Returns the number of sectors to allocate for an inode SIZE
  * bytes long. */
@@ -46,10 +50,14 @@ byte_to_sector (const struct inode *inode, off_t pos) {
  * returns the same `struct inode'. */
 static struct list open_inodes;
 
+/* Cache of struct inode. */
+static struct kmem_cache *inode_slab;
+
 /* Initializes the inode module. */
 void
 inode_init (void) {
 	list_init (&open_inodes);
+	inode_slab = kmem_cache_create ("inode", sizeof (struct inode), NULL);
 }
 
 /* Initializes an inode with LENGTH bytes of data and
@@ -132,9 +140,15 @@ inode_open (disk_sector_t sector) {
 		}
 	}
 	/* Allocate memory. */
-	inode = malloc (sizeof *inode);
+	inode = kmem_cache_alloc (inode_slab);
 	if (inode == NULL)
 		return NULL;
+#ifdef VM
+	if (!page_cache_inode_init (inode)) {
+		kmem_cache_free (inode_slab, inode);
+		return NULL;
+	}
+#endif
 
 	/* Initialize. */
 	list_push_front (&open_inodes, &inode->elem);
@@ -174,6 +188,9 @@ inode_close (struct inode *inode) {
 	if (--inode->open_cnt == 0) {
 		/* Remove from inode list and release lock. */
 		list_remove (&inode->elem);
+#ifdef VM
+		page_cache_inode_release (inode);
+#endif
 
 		/* Deallocate blocks if removed. */
 		if (inode->removed) {
@@ -182,7 +199,7 @@ inode_close (struct inode *inode) {
 				fat_remove_chain (inode->data.start, 0); // 이후 data start부터 chain을 따라가며 remove
 		}
 
-		free (inode); 
+		kmem_cache_free (inode_slab, inode);
 	}
 }
 
@@ -216,9 +233,20 @@ inode_remove (struct inode *inode) {
 
 /* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
  * Returns the number of bytes actually read, which may be less
- * than SIZE if an error occurs or end of file is reached. */
+ * than SIZE if an error occurs or end of file is reached.
+ * Regular files are read through the page cache. */
 off_t
 inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset) {
+#ifdef VM
+	if (inode->data.is_file)
+		return page_cache_read (inode, buffer_, size, offset);
+#endif
+	return inode_read_uncached (inode, buffer_, size, offset);
+}
+
+/* Like inode_read_at, but always reads from the disk. */
+off_t
+inode_read_uncached (struct inode *inode, void *buffer_, off_t size, off_t offset) {
 	uint8_t *buffer = buffer_;
 	off_t bytes_read = 0;
 	uint8_t *bounce = NULL;
@@ -355,6 +383,10 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
 		inode->data.length = size + offset;
 		disk_write (filesys_disk, inode->sector, &inode->data);
 	}
+#ifdef VM
+	if (inode->data.is_file)
+		page_cache_write (inode, buffer_, bytes_written, offset - bytes_written);
+#endif
 	return bytes_written;
 }
 
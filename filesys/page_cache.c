@@ -1,6 +1,23 @@
 /* page_cache.c: Implementation of Page Cache (Buffer Cache). */
 
 #include "vm/vm.h"
+#include "filesys/inode.h"
+#include "threads/vaddr.h"
+#include <stdio.h>
+#include <string.h>
+
+/* The page cache keeps the pages of regular files in frames of the
+ * user pool: one page of type VM_PAGE_CACHE for each page-aligned
+ * offset, in a hash table of the inode.  read() copies out of these
+ * frames and mmap faults map them, so that a file that is both read
+ * and mapped is in memory only once.  write() goes to the disk and to
+ * the cached page alike, so the cache never holds data of its own to
+ * write back; dirty mappings are written back through their own
+ * pages.  The frames are evicted like any other, and a page whose
+ * frame was evicted is read again on the next use.  The tables are
+ * protected by filesys_lock. */
+
+#ifdef VM
 static bool page_cache_readahead (struct page *page, void *kva);
 static bool page_cache_writeback (struct page *page);
 static void page_cache_destroy (struct page *page);
@@ -15,6 +32,9 @@ static const struct page_operations page_cache_op = {
 
 tid_t page_cache_workerd;
 
+static long long cache_reads;	/* Pages read from the disk into the cache. */
+static long long cache_hits;	/* Pages of read() served from the cache. */
+
 /* The initializer of file vm */
 void
 pagecache_init (void) {
@@ -23,28 +43,177 @@ pagecache_init (void) {
 
 /* Initialize the page cache */
 bool
-page_cache_initializer (struct page *page, enum vm_type type, void *kva) {
+page_cache_initializer (struct page *page, enum vm_type type UNUSED, void *kva UNUSED) {
 	/* Set up the handler */
 	page->operations = &page_cache_op;
-
+	return true;
 }
 
 /* Utilze the Swap in mechanism to implement readhead */
 static bool
 page_cache_readahead (struct page *page, void *kva) {
+	struct page_cache *cache = &page->page_cache;
+	off_t left = inode_length(cache->inode) - cache->ofs;
+	off_t bytes = left < PGSIZE ? (left > 0 ? left : 0) : PGSIZE;
+
+	bytes = inode_read_uncached(cache->inode, kva, bytes, cache->ofs);
+	memset(kva + bytes, 0, PGSIZE - bytes);
+	page->swapped_out = false;
+	cache_reads++;
+	return true;
 }
 
 /* Utilze the Swap out mechanism to implement writeback */
 static bool
 page_cache_writeback (struct page *page) {
+	/* Writes go through to the disk, nothing to do. */
+	return true;
 }
 
-/* Destory the page_cache. */
+/* Destory the page_cache.  Unlike other pages, PAGE is freed here,
+ * or by the evictor if it is being evicted right now. */
 static void
 page_cache_destroy (struct page *page) {
+	if (vm_cache_detach(page))
+		kmem_cache_free(page_slab, page);
 }
 
 /* Worker thread for page cache */
 static void
 page_cache_kworkerd (void *aux) {
 }
+
+static uint64_t
+cache_hash (const struct hash_elem *e, void *aux UNUSED) {
+	const struct page *page = hash_entry(e, struct page, page_cache.elem);
+	return hash_int(page->page_cache.ofs);
+}
+
+static bool
+cache_less (const struct hash_elem *a, const struct hash_elem *b, void *aux UNUSED) {
+	return hash_entry(a, struct page, page_cache.elem)->page_cache.ofs
+			< hash_entry(b, struct page, page_cache.elem)->page_cache.ofs;
+}
+
+static void
+cache_free (struct hash_elem *e, void *aux UNUSED) {
+	struct page *page = hash_entry(e, struct page, page_cache.elem);
+
+	destroy(page);
+}
+
+/* Sets up the page cache of INODE, which is being opened. */
+bool
+page_cache_inode_init (struct inode *inode) {
+	return hash_init(&inode->cache_pages, cache_hash, cache_less, NULL);
+}
+
+/* Drops the page cache of INODE, which is being closed for the last
+ * time.  Nothing maps its pages any more, since every mapping keeps
+ * the file open. */
+void
+page_cache_inode_release (struct inode *inode) {
+	hash_destroy(&inode->cache_pages, cache_free);
+}
+
+/* Returns the page of the cache of INODE for the page-aligned OFS,
+ * creating it, without a frame, if there is none.  Returns NULL if
+ * memory is short.  Must hold filesys_lock. */
+struct page *
+page_cache_get (struct inode *inode, off_t ofs) {
+	struct page key, *page;
+	struct hash_elem *e;
+
+	ASSERT (ofs % PGSIZE == 0);
+
+	key.page_cache.ofs = ofs;
+	e = hash_find(&inode->cache_pages, &key.page_cache.elem);
+	if (e != NULL)
+		return hash_entry(e, struct page, page_cache.elem);
+
+	page = kmem_cache_alloc(page_slab);
+	if (page == NULL)
+		return NULL;
+	page_cache_initializer(page, VM_PAGE_CACHE, NULL);
+	page->va = NULL;
+	page->frame = NULL;
+	page->writable = false;
+	page->cow_writable = false;
+	page->swapped_out = false;
+	page->busy = false;
+	page->fork_pending = false;
+	page->advice = VM_ADV_NORMAL;
+	page->mlocked = false;
+	page->owner = NULL;
+	page->page_cache.inode = inode;
+	page->page_cache.ofs = ofs;
+	hash_insert(&inode->cache_pages, &page->page_cache.elem);
+	return page;
+}
+
+/* Reads SIZE bytes from INODE, a regular file, into BUFFER, starting
+ * at OFFSET, through the page cache.  Pages that are not cached are
+ * read in if a frame is free, and straight from the disk otherwise:
+ * a read never evicts.  Returns the number of bytes read.  Must hold
+ * filesys_lock. */
+off_t
+page_cache_read (struct inode *inode, void *buffer_, off_t size, off_t offset) {
+	uint8_t *buffer = buffer_;
+	off_t length = inode_length(inode), bytes_read = 0;
+
+	if (offset >= length || size <= 0)
+		return 0;
+	if (size > length - offset)
+		size = length - offset;
+
+	while (size > 0) {
+		off_t page_ofs = offset % PGSIZE;
+		off_t chunk = PGSIZE - page_ofs < size ? PGSIZE - page_ofs : size;
+		struct page *page = page_cache_get(inode, offset - page_ofs);
+
+		if (page != NULL && (vm_cache_copy(page, page_ofs, buffer + bytes_read, chunk, false)
+					|| (vm_cache_fill(page)
+						&& vm_cache_copy(page, page_ofs, buffer + bytes_read, chunk, false))))
+			cache_hits++;
+		else if (inode_read_uncached(inode, buffer + bytes_read, chunk, offset) != chunk)
+			break;
+
+		size -= chunk;
+		offset += chunk;
+		bytes_read += chunk;
+	}
+	return bytes_read;
+}
+
+/* Copies the SIZE bytes at BUFFER, which were just written to INODE
+ * at OFFSET, into the cached pages of INODE that hold them.  Must
+ * hold filesys_lock. */
+void
+page_cache_write (struct inode *inode, const void *buffer_, off_t size, off_t offset) {
+	const uint8_t *buffer = buffer_;
+	struct page key;
+	struct hash_elem *e;
+
+	while (size > 0) {
+		off_t page_ofs = offset % PGSIZE;
+		off_t chunk = PGSIZE - page_ofs < size ? PGSIZE - page_ofs : size;
+
+		key.page_cache.ofs = offset - page_ofs;
+		e = hash_find(&inode->cache_pages, &key.page_cache.elem);
+		if (e != NULL)
+			vm_cache_copy(hash_entry(e, struct page, page_cache.elem),
+					page_ofs, (void *) buffer, chunk, true);
+		size -= chunk;
+		offset += chunk;
+		buffer += chunk;
+	}
+}
+
+/* Prints page cache statistics.  MAPPED is the number of mmap faults
+ * that were served from the cache. */
+void
+page_cache_print_stats (long long mapped) {
+	printf ("Page cache: %lld pages read in, %lld read() hits, %lld mmap faults served\n",
+			cache_reads, cache_hits, mapped);
+}
+#endif /* VM */
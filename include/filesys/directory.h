@@ -27,6 +27,7 @@ struct dir_entry {
 };
 
 /* Opening and closing directories. */
+void dir_init (void);
 bool dir_create (disk_sector_t sector, size_t entry_cnt, disk_sector_t parent_sector, char *dir_name);
 struct dir *dir_open (struct inode *);
 struct dir *dir_open_root (void);
@@ -3,6 +3,7 @@
 
 #include <stdbool.h>
 #include <list.h>
+#include <hash.h>
 #include "filesys/off_t.h"
 #include "devices/disk.h"
 
@@ -31,6 +32,9 @@ struct inode {
 	bool removed;                       /* True if deleted, false otherwise. */
 	int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
 	struct inode_disk data;             /* Inode content. */
+#ifdef VM
+	struct hash cache_pages;            /* Page cache, see page_cache.c. */
+#endif
 };
 
 void inode_init (void);
@@ -41,6 +45,7 @@ disk_sector_t inode_get_inumber (const struct inode *);
 void inode_close (struct inode *);
 void inode_remove (struct inode *);
 off_t inode_read_at (struct inode *, void *, off_t size, off_t offset);
+off_t inode_read_uncached (struct inode *, void *, off_t size, off_t offset);
 off_t inode_write_at (struct inode *, const void *, off_t size, off_t offset);
 void inode_deny_write (struct inode *);
 void inode_allow_write (struct inode *);
@@ -1,12 +1,26 @@
 #ifndef FILESYS_PAGE_CACHE_H
 #define FILESYS_PAGE_CACHE_H
-#include "vm/vm.h"
+#include <stdbool.h>
+#include <hash.h>
+#include "filesys/off_t.h"
 
 struct page;
+struct inode;
 enum vm_type;
 
-struct page_cache {};
+/* A page of a regular file held by the page cache. */
+struct page_cache {
+	struct inode *inode;		/* NULL once the inode let go of it. */
+	off_t ofs;					/* Page-aligned offset in the file. */
+	struct hash_elem elem;		/* In the cache_pages of the inode. */
+};
 
 void page_cache_init (void);
 bool page_cache_initializer (struct page *page, enum vm_type type, void *kva);
+bool page_cache_inode_init (struct inode *inode);
+void page_cache_inode_release (struct inode *inode);
+struct page *page_cache_get (struct inode *inode, off_t ofs);
+off_t page_cache_read (struct inode *inode, void *buffer, off_t size, off_t offset);
+void page_cache_write (struct inode *inode, const void *buffer, off_t size, off_t offset);
+void page_cache_print_stats (long long mapped);
 #endif
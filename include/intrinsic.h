@@ -43,6 +43,49 @@ static __inline uint64_t read_eflags(void) {
 	return rflags;
 }
 
+/* Write-protect bit of CR0: when set, the kernel honours read-only
+   page table entries too. */
+#define CR0_WP 0x00010000
+
+__attribute__((always_inline))
+static __inline void lcr0(uint64_t val) {
+	__asm __volatile("movq %0, %%cr0" : : "r" (val));
+}
+
+__attribute__((always_inline))
+static __inline uint64_t rcr0(void) {
+	uint64_t val;
+	__asm __volatile("movq %%cr0,%0" : "=r" (val));
+	return val;
+}
+
+/* Process-context identifiers enable bit of CR4: when set, the low
+   12 bits of CR3 tag the TLB entries of the address space. */
+#define CR4_PCIDE 0x00020000
+
+/* Bit 63 of a value loaded into CR3: keep the TLB entries of the PCID. */
+#define CR3_NOFLUSH (1ULL << 63)
+
+__attribute__((always_inline))
+static __inline void lcr4(uint64_t val) {
+	__asm __volatile("movq %0, %%cr4" : : "r" (val));
+}
+
+__attribute__((always_inline))
+static __inline uint64_t rcr4(void) {
+	uint64_t val;
+	__asm __volatile("movq %%cr4,%0" : "=r" (val));
+	return val;
+}
+
+/* Returns ECX of CPUID leaf LEAF. */
+__attribute__((always_inline))
+static __inline uint32_t cpuid_ecx(uint32_t leaf) {
+	uint32_t eax = leaf, ebx, ecx = 0, edx;
+	__asm __volatile("cpuid" : "+a" (eax), "=b" (ebx), "+c" (ecx), "=d" (edx));
+	return ecx;
+}
+
 __attribute__((always_inline))
 static __inline uint64_t rcr3(void) {
 	uint64_t val;
@@ -36,6 +36,13 @@ enum {
 
 	SYS_MOUNT,
 	SYS_UMOUNT,
+
+	/* Extra for Project 3 */
+	SYS_SPAWN,                  /* Start a child running a new program. */
+	SYS_MADVISE,                /* Advise how memory will be used. */
+	SYS_MSYNC,                  /* Write back a file mapping. */
+	SYS_MLOCK,                  /* Lock pages in memory. */
+	SYS_MUNLOCK,                /* Unlock pages. */
 };
 
 #endif /* lib/syscall-nr.h */
@@ -13,6 +13,22 @@ typedef int pid_t;
 typedef int off_t;
 #define MAP_FAILED ((void *) NULL)
 
+/* Or'd into the WRITABLE argument of mmap() to fault the whole
+ * mapping in at once. */
+#define MAP_POPULATE 0x2
+
+/* Advice for madvise(). */
+#define MADV_NORMAL 0           /* No special treatment. */
+#define MADV_RANDOM 1           /* No readahead. */
+#define MADV_SEQUENTIAL 2       /* Aggressive readahead. */
+#define MADV_WILLNEED 3         /* Bring the pages in now. */
+#define MADV_DONTNEED 4         /* Drop the pages now. */
+
+/* Flags for msync(). */
+#define MS_ASYNC 1              /* Leave it to the writeback thread. */
+#define MS_INVALIDATE 2         /* Accepted; mappings are never stale. */
+#define MS_SYNC 4               /* Write back before returning. */
+
 /* Maximum characters in a filename written by readdir(). */
 #define READDIR_MAX_LEN 14
 
@@ -37,10 +53,15 @@ unsigned tell (int fd);
 void close (int fd);
 
 int dup2(int oldfd, int newfd);
+pid_t spawn (const char *cmd_line);
 
 /* Project 3 and optionally project 4. */
 void *mmap (void *addr, size_t length, int writable, int fd, off_t offset);
 void munmap (void *addr);
+int madvise (void *addr, size_t length, int advice);
+int msync (void *addr, size_t length, int flags);
+int mlock (const void *addr, size_t length);
+int munlock (const void *addr, size_t length);
 
 /* Project 4 only. */
 bool chdir (const char *dir);
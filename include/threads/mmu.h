@@ -2,6 +2,7 @@
 #define THREAD_MMU_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include "threads/pte.h"
 
@@ -12,14 +13,40 @@ uint64_t *pml4_create (void);
 bool pml4_for_each (uint64_t *, pte_for_each_func *, void *);
 void pml4_destroy (uint64_t *pml4);
 void pml4_activate (uint64_t *pml4);
+void pml4_init_pcid (void);
+void pml4_print_stats (void);
 void *pml4_get_page (uint64_t *pml4, const void *upage);
 bool pml4_set_page (uint64_t *pml4, void *upage, void *kpage, bool rw);
-void pml4_clear_page (uint64_t *pml4, void *upage);
+bool pml4_set_huge_page (uint64_t *pml4, void *upage, void *kpage, bool rw);
+bool pml4_clear_page (uint64_t *pml4, void *upage);
+void *pml4_clear_huge_page (uint64_t *pml4, void *upage, bool *dirty);
 bool pml4_is_dirty (uint64_t *pml4, const void *upage);
+bool pml4_is_writable (uint64_t *pml4, const void *upage);
 void pml4_set_dirty (uint64_t *pml4, const void *upage, bool dirty);
 bool pml4_is_accessed (uint64_t *pml4, const void *upage);
 void pml4_set_accessed (uint64_t *pml4, const void *upage, bool accessed);
 
+/* A batch of changes to the entries of one page map whose TLB flush
+ * is put off until mmu_gather_finish(), which then invalidates the
+ * pages one by one or flushes the whole TLB, whichever is cheaper.
+ * Page tables left empty by cleared pages are freed after the flush.
+ * While it runs, the pml4_*() changes the starting thread makes to
+ * PML4 join the batch; it must not touch those pages from user
+ * addresses until the batch is finished. */
+#define MMU_GATHER_PAGES 32
+#define MMU_GATHER_TABLES 16
+struct mmu_gather {
+	uint64_t *pml4;
+	size_t cnt;                           /* Pages changed. */
+	const void *pages[MMU_GATHER_PAGES];  /* The first of them. */
+	size_t table_cnt;
+	void *tables[MMU_GATHER_TABLES];      /* Tables to free after flush. */
+	uint64_t pt_base;                     /* 2 MB block last cleared in. */
+};
+
+void mmu_gather_start (struct mmu_gather *tlb, uint64_t *pml4);
+void mmu_gather_finish (struct mmu_gather *tlb);
+
 #define is_writable(pte) (*(pte) & PTE_W)
 #define is_user_pte(pte) (*(pte) & PTE_U)
 #define is_kern_pte(pte) (!is_user_pte (pte))
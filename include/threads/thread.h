@@ -119,6 +119,7 @@ struct thread {
 #ifdef USERPROG
 	/* Owned by userprog/process.c. */
 	uint64_t *pml4;                     /* Page map level 4 */
+	struct mmu_gather *tlb;             /* Batched TLB flushes, or NULL. */
 #endif
 #ifdef VM
 	/* Table for whole virtual memory owned by thread. */
@@ -14,6 +14,7 @@
 
 tid_t process_create_initd (const char *file_name);
 tid_t process_fork (const char *name, struct intr_frame *if_, int* parent_lock);
+tid_t process_spawn (const char *cmd_line);
 int process_exec (void *f_name);
 int process_wait (tid_t);
 void process_exit (void);
@@ -36,4 +37,7 @@ struct file_elem {
   struct dir* dir;
 };
 
+/* Cache of struct file_elem. */
+extern struct kmem_cache *file_elem_slab;
+
 #endif /* userprog/process.h */
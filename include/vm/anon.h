@@ -2,15 +2,45 @@
 #define VM_ANON_H
 #include "vm/vm.h"
 #include "devices/disk.h"
+#include "filesys/off_t.h"
 struct page;
+struct file;
+struct zswap_entry;
 enum vm_type;
 
+/* Marks an anonymous page that does not own a swap slot. */
+#define SWAP_SLOT_NONE ((disk_sector_t) -1)
+
+/* Largest number of pages written to swap with one disk request. */
+#define SWAP_CLUSTER_MAX 16
+
+/* Largest number of neighbouring slots read ahead on a swap-in. */
+#define SWAP_RA_MAX 8
+
+/* Per-process swap readahead state.  The window grows while the
+ * pages read ahead get used and shrinks while they do not. */
+struct swap_ra {
+  struct page *pages[SWAP_RA_MAX];	/* Pages brought in by the last readahead. */
+  size_t cnt;						/* Number of entries in PAGES. */
+  size_t window;					/* Slots to read ahead next time. */
+};
+
 struct anon_page {
-  disk_sector_t page_sec_idx;
-  struct list_elem elem;
+  disk_sector_t page_sec_idx;	/* Swap slot, or SWAP_SLOT_NONE. */
+  struct zswap_entry *zswap;	/* Compressed copy, if in the zswap pool. */
+
+  /* For VM_TEXT pages: where the contents are read from.  These pages
+   * are never written to swap, only dropped and read again. */
+  struct file *text_file;
+  off_t text_ofs;
+  size_t text_read_bytes;
 };
 
 void vm_anon_init (void);
 bool anon_initializer (struct page *page, enum vm_type type, void *kva);
+void anon_swap_out_cluster (struct page **pages, size_t cnt);
+void anon_swap_out_buffer (struct page *page, void *buf);
+void swap_ra_init (struct swap_ra *ra);
+void anon_print_stats (void);
 
 #endif
@@ -11,7 +11,6 @@ struct file_page {
 	off_t offset;
 	uint32_t data_bytes;
 	uint32_t zero_bytes;
-	bool is_last;
 };
 
 void vm_file_init (void);
@@ -19,4 +18,5 @@ bool file_backed_initializer (struct page *page, enum vm_type type, void *kva);
 void *do_mmap(void *addr, size_t length, int writable,
 		struct file *file, off_t offset);
 void do_munmap (void *va);
+bool mmap_set_page (struct page *page, void *aux);
 #endif
@@ -0,0 +1,56 @@
+#ifndef VM_REGION_H
+#define VM_REGION_H
+#include "vm/vm.h"
+#include "filesys/off_t.h"
+#include <stddef.h>
+
+struct page;
+struct file;
+enum vm_type;
+
+/* A region [START, END) of a process's address space, such as an mmap
+ * or a segment of the executable.  Its pages are created only when
+ * they are first touched.  The first FILE_BYTES bytes of the region
+ * come from FILE at OFFSET and the rest is zeros; without a FILE the
+ * region is all zeros. */
+struct vm_region {
+	void *start;
+	void *end;
+	struct file *file;		/* Owned by the region. */
+	off_t offset;
+	size_t file_bytes;
+	enum vm_type type;		/* Type, with markers, of the pages. */
+	bool writable;
+	vm_initializer *init;	/* Initializer of the pages that read FILE. */
+	enum vm_advice advice;
+	bool mmap_cont;			/* Rest of the mmap below, split by madvise. */
+
+	/* AVL tree links, ordered by START. */
+	struct vm_region *left;
+	struct vm_region *right;
+	int height;
+};
+
+/* The regions of one address space.  Regions never overlap.  Only
+ * the owning process uses them, or its parent while it forks. */
+struct region_tree {
+	struct vm_region *root;
+	size_t cnt;
+};
+
+void region_tree_init (struct region_tree *tree);
+struct vm_region *region_find (struct region_tree *tree, void *va);
+struct vm_region *region_find_next (struct region_tree *tree, void *va);
+void *region_map_end (struct region_tree *tree, struct vm_region *r);
+bool region_overlaps (struct region_tree *tree, void *start, void *end);
+bool region_add (struct region_tree *tree, void *start, void *end,
+		struct file *file, off_t offset, size_t file_bytes,
+		enum vm_type type, bool writable, vm_initializer *init);
+void region_remove (struct region_tree *tree, void *start, void *end);
+bool region_advise (struct region_tree *tree, void *start, void *end,
+		enum vm_advice advice);
+bool region_tree_copy (struct region_tree *dst, struct region_tree *src);
+void region_tree_destroy (struct region_tree *tree);
+struct page *region_fault_in (struct vm_region *region, void *va);
+
+#endif
@@ -2,6 +2,8 @@
 #define VM_VM_H
 #include <stdbool.h>
 #include "threads/palloc.h"
+#include "threads/slab.h"
+#include "threads/synch.h"
 #include <hash.h>
 
 enum vm_type {
@@ -25,18 +27,33 @@ enum vm_type {
 	VM_MARKER_END = (1 << 31),
 };
 
+/* How a process expects to touch a range of its memory, given with
+ * madvise(). */
+enum vm_advice {
+	VM_ADV_NORMAL,			/* Default readahead and fault-around. */
+	VM_ADV_RANDOM,			/* No readahead, no fault-around. */
+	VM_ADV_SEQUENTIAL,		/* Read ahead of every fault. */
+};
+
 #include "vm/uninit.h"
 #include "vm/anon.h"
 #include "vm/file.h"
-#ifdef EFILESYS
+#include "vm/region.h"
 #include "filesys/page_cache.h"
-#endif
 
 struct page_operations;
 struct thread;
 
 #define VM_TYPE(type) ((type) & 7)
 
+/* Marks an anonymous page whose initial contents are all zeros, which
+ * may be backed by the shared zero frame until it is first written. */
+#define VM_ZERO_FILL VM_MARKER_0
+
+/* Marks a read-only page of an executable, whose frame is shared by
+ * every process mapping the same part of the same file. */
+#define VM_TEXT VM_MARKER_1
+
 /* The representation of "page".
  * This is kind of "parent class", which has four "child class"es, which are
  * uninit_page, file_page, anon_page, and page cache (project4).
@@ -47,11 +64,13 @@ struct page {
 	struct frame *frame;   /* Back reference for frame */
 
 	/* Your implementation */
-	struct hash_elem spt_hash_elem;
 	bool writable;
 	bool cow_writable;
 	bool swapped_out;
-	struct hash_elem swapped_disk_hash_elem;
+	bool busy;				/* Being faulted in or evicted, see vm_page_busy. */
+	bool fork_pending;		/* Not copied yet by a child, see fork_pull. */
+	enum vm_advice advice;	/* Of the region the page belongs to. */
+	bool mlocked;			/* Holds a pin on its frame, see vm_mlock. */
 	struct thread* owner;
 	struct list_elem referer_elem;
 
@@ -61,19 +80,30 @@ struct page {
 		struct uninit_page uninit;
 		struct anon_page anon;
 		struct file_page file;
-#ifdef EFILESYS
 		struct page_cache page_cache;
-#endif
 	};
 };
 
-/* The representation of "frame" */
+/* The representation of "frame".  There is one for every frame of
+ * the user pool, kept in an array indexed by frame number, so that
+ * vm_frame_of() finds it from the kernel address of the frame. */
 struct frame {
 	void *kva;
-	void *original_kva;
 	struct page *page;
-	struct list_elem elem;
-	struct list referers;
+	unsigned refcnt;			/* Pages in REFERERS. */
+	unsigned flags;				/* FRAME_* bits. */
+	unsigned pin_cnt;			/* Pins; never evicted while nonzero. */
+	struct list_elem elem;		/* LRU list link, if FRAME_LRU. */
+	struct list referers;		/* Pages mapping the frame. */
+
+	/* Set while the frame is in the shared text table. */
+	struct inode *text_inode;
+	off_t text_ofs;
+	struct hash_elem text_elem;
+
+	/* Same-page merging, see ksmd. */
+	uint64_t ksm_sum;			/* Checksum of the contents at the last look. */
+	struct hash_elem ksm_elem;	/* In the merge table, if FRAME_KSM. */
 };
 
 /* The function table for page operations.
@@ -92,11 +122,18 @@ struct page_operations {
 #define destroy(page) \
 	if ((page)->operations->destroy) (page)->operations->destroy (page)
 
+struct fork_link;
+
 /* Representation of current process's memory space.
  * We don't want to force you to obey any specific design for this struct.
  * All designs up to you for this. */
 struct supplemental_page_table {
-	struct hash hash;
+	void **root;			/* Radix tree of pages, see spt_find_page. */
+	struct lock lock;		/* Protects ROOT. */
+	struct swap_ra ra;
+	struct region_tree regions;	/* Mappings whose pages are not all created. */
+	struct fork_link *lazy_child;	/* Child that has pages to copy from us. */
+	struct fork_link *lazy_parent;	/* Parent we have pages to copy from. */
 };
 
 #include "threads/thread.h"
@@ -106,10 +143,47 @@ bool supplemental_page_table_copy (struct supplemental_page_table *dst,
 void supplemental_page_table_kill (struct supplemental_page_table *spt);
 struct page *spt_find_page (struct supplemental_page_table *spt,
 		void *va);
+struct page *spt_find_next (struct supplemental_page_table *spt,
+		void *start, void *end);
 bool spt_insert_page (struct supplemental_page_table *spt, struct page *page);
 void spt_remove_page (struct supplemental_page_table *spt, struct page *page);
+bool spt_range_empty (struct supplemental_page_table *spt, void *start, void *end);
+bool spt_is_writable (struct supplemental_page_table *spt, void *va);
+void fork_push (struct page *page);
+bool fork_pull (void *va, struct page **copy);
+void fork_forget (void *start, void *end);
+bool vm_advise (void *start, void *end, enum vm_advice advice);
+size_t vm_populate (void *start, void *end, bool speculative);
+void vm_drop_range (void *start, void *end);
+void vm_msync (void *start, void *end);
+bool vm_cache_copy (struct page *page, off_t ofs, void *buf, size_t size, bool to_page);
+bool vm_cache_fill (struct page *page);
+bool vm_cache_detach (struct page *page);
+bool vm_pin_range (const void *uaddr, size_t size, bool write);
+void vm_unpin_range (const void *uaddr, size_t size);
+bool vm_mlock (void *start, void *end);
+void vm_munlock (void *start, void *end);
+
+/* Free user pages below which the reclaim thread is woken, and the
+ * count it reclaims up to. */
+extern size_t vm_low_watermark;
+extern size_t vm_high_watermark;
+
+/* Pages of read-only executable segments populated together on a fault. */
+extern size_t vm_fault_around;
+
+/* Map suitable 2 MB blocks of mappings with one page directory entry. */
+extern bool vm_huge_pages;
+
+/* Seconds between writebacks of dirty file mappings, 0 for never. */
+extern size_t vm_writeback_secs;
+
+/* Pages looked at by the same-page merging thread every 100 ms, 0
+ * for none. */
+extern size_t vm_ksm_pages;
 
 void vm_init (void);
+void vm_print_stats (void);
 bool vm_try_handle_fault (struct intr_frame *f, void *addr, bool user,
 		bool write, bool not_present);
 
@@ -123,19 +197,32 @@ static bool vm_do_claim_page (struct page *page);
 enum vm_type page_get_type (struct page *page);
 void after_stack_set(struct page *page, void *aux);
 void common_clear_page(struct page *page);
+void vm_page_busy (struct page *page);
+bool vm_page_try_busy (struct page *page);
+void vm_page_unbusy (struct page *page);
+/* Frame flags. */
+#define FRAME_LRU 0x1			/* On the LRU list, may be evicted. */
+#define FRAME_DIRTY 0x2			/* Written since read from its file. */
+#define FRAME_KSM 0x4			/* In the merge table, contents fixed. */
+
+struct frame *vm_frame_of (void *kva);
+struct frame *vm_try_get_frame (void);
+bool vm_map_frame (struct page *page, struct frame *frame);
+
+/* Object caches of struct page and of the aux of lazily loaded pages. */
+extern struct kmem_cache *page_slab;
+extern struct kmem_cache *lazy_parameter_slab;
+extern struct kmem_cache *mmap_parameter_slab;
 
 void* copy_lazy_parameter(struct page* src, void* dst);
 void* copy_mmap_parameter(struct page* src, void* dst);
 void copy_file_page(struct file_page* src, struct file_page* dst);
 
-unsigned page_hash (const struct hash_elem *h_el, void *aux UNUSED);
-bool page_less (const struct hash_elem *a_, const struct hash_elem *b_, void *aux UNUSED);
 struct mmap_parameter {
 	struct file* file;
 	off_t offset;
 	uint32_t data_bytes;
 	uint32_t zero_bytes;
-	bool is_last;
 };
 
 struct lazy_parameter {
@@ -0,0 +1,13 @@
+/* Tries to spawn a nonexistent process.
+   The child must exit with -1, which wait returns. */
+
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+void
+test_main (void) 
+{
+  msg ("wait(spawn(\"no-such-file\")) = %d",
+       wait (spawn ("no-such-file")));
+}
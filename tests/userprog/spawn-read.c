@@ -0,0 +1,40 @@
+/* Spawns a child that reads from a file descriptor it inherits,
+   then reads the rest of the file in the parent. */
+
+#include <stdio.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/userprog/boundary.h"
+#include "tests/userprog/sample.inc"
+#include "tests/lib.h"
+#include "tests/main.h"
+
+void
+test_main (void)
+{
+  char cmd_line[128];
+  int handle;
+  int byte_cnt;
+  char *buffer;
+
+  CHECK ((handle = open ("sample.txt")) > 1, "open \"sample.txt\"");
+  buffer = get_boundary_area () - sizeof sample / 2;
+  CHECK ((byte_cnt = read (handle, buffer, 20)) == 20,
+         "read \"sample.txt\" first 20 bytes");
+
+  snprintf (cmd_line, sizeof cmd_line, "%s %d", "child-read", handle);
+  if (wait (spawn (cmd_line)) != 0)
+    fail ("child-read failed");
+
+  byte_cnt = read (handle, buffer + 20, sizeof sample - 21);
+  if (byte_cnt != sizeof sample - 21)
+    fail ("read() returned %d instead of %zu", byte_cnt, sizeof sample - 21);
+  else if (strcmp (sample, buffer)) {
+    msg ("expected text:\n%s", sample);
+    msg ("text actually read:\n%s", buffer);
+    fail ("expected text differs from actual");
+  } else
+    msg ("Parent success");
+
+  close (handle);
+}
@@ -0,0 +1,71 @@
+/* Shares anonymous pages and a file mapping with a child that reads
+   all of them, writes to half of the anonymous pages and exits.  The
+   parent is then the last process on each frame and writes to all
+   of them.  It must see its own data, not the child's, and its
+   writes to the mapping must reach the file. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/vm/sample.inc"
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define PAGE_SIZE 4096
+#define PAGE_COUNT 8
+#define ACTUAL ((char *) 0x10000000)
+
+static char pages[PAGE_COUNT * PAGE_SIZE];
+
+/* Returns true if every page I starts with FIRST plus I. */
+static bool
+pages_are (char first)
+{
+	size_t i;
+
+	for (i = 0; i < PAGE_COUNT; i++)
+		if (pages[i * PAGE_SIZE] != (char) (first + i))
+			return false;
+	return true;
+}
+
+static void
+write_pages (char first, size_t step)
+{
+	size_t i;
+
+	for (i = 0; i < PAGE_COUNT; i += step)
+		pages[i * PAGE_SIZE] = first + i;
+}
+
+void
+test_main (void)
+{
+	char buf[sizeof sample];
+	int handle;
+	pid_t child;
+
+	write_pages ('a', 1);
+	CHECK ((handle = open ("sample.txt")) > 1, "open \"sample.txt\"");
+	CHECK (mmap (ACTUAL, PAGE_SIZE, 1, handle, 0) != MAP_FAILED, "mmap \"sample.txt\"");
+
+	child = fork ("child");
+	if (child == 0) {
+		if (!pages_are ('a') || memcmp (ACTUAL, sample, strlen (sample)))
+			exit (1);
+		write_pages ('A', 2);
+		exit (0);
+	}
+	CHECK (wait (child) == 0, "wait for child");
+
+	CHECK (pages_are ('a'), "check parent's pages");
+	write_pages ('x', 1);
+	CHECK (pages_are ('x'), "write parent's pages");
+
+	ACTUAL[0] = 'X';
+	munmap (ACTUAL);
+	CHECK (read (handle, buf, strlen (sample)) == (int) strlen (sample),
+			"read \"sample.txt\"");
+	CHECK (buf[0] == 'X' && !memcmp (buf + 1, sample + 1, strlen (sample) - 1),
+			"check written data");
+	close (handle);
+}
@@ -0,0 +1,16 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(cow-reuse) begin
+(cow-reuse) open "sample.txt"
+(cow-reuse) mmap "sample.txt"
+(cow-reuse) wait for child
+(cow-reuse) check parent's pages
+(cow-reuse) write parent's pages
+(cow-reuse) read "sample.txt"
+(cow-reuse) check written data
+(cow-reuse) end
+EOF
+pass;
@@ -0,0 +1,44 @@
+/* Forks a child that forks again before it touches its memory, and
+   checks that the child, the grandchild and the parent all see what
+   the parent wrote to .data and .bss before the first fork. */
+
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define PAGE_SIZE 4096
+
+/* Byte PAGE_SIZE of each array lies in a page of its own. */
+static char data_buf[2 * PAGE_SIZE] = { 'a' };
+static char bss_buf[2 * PAGE_SIZE];
+
+static bool
+bufs_written (void)
+{
+	return data_buf[PAGE_SIZE] == 'D' && bss_buf[PAGE_SIZE] == 'B';
+}
+
+void
+test_main (void)
+{
+	pid_t child, grandchild;
+
+	data_buf[PAGE_SIZE] = 'D';
+	bss_buf[PAGE_SIZE] = 'B';
+
+	child = fork ("child");
+	if (child == 0) {
+		grandchild = fork ("grandchild");
+		if (grandchild == 0) {
+			if (!bufs_written ())
+				exit (1);
+			data_buf[PAGE_SIZE] = bss_buf[PAGE_SIZE] = 'x';
+			exit (0);
+		}
+		if (wait (grandchild) != 0)
+			exit (2);
+		exit (bufs_written () ? 0 : 3);
+	}
+	CHECK (wait (child) == 0, "wait for child");
+	CHECK (bufs_written (), "check parent's data");
+}
@@ -0,0 +1,11 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(fork-nested) begin
+(fork-nested) wait for child
+(fork-nested) check parent's data
+(fork-nested) end
+EOF
+pass;
@@ -0,0 +1,55 @@
+/* Writes to every page of a buffer larger than memory, so that most
+   of it is on swap, then forks.  The child checks every page and
+   writes its own data over it; the parent then checks that it still
+   has its own.  The pages the child takes from the parent have to
+   come in from swap first, and must stay read-only while shared. */
+
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define PAGE_SIZE 4096
+#define CHUNK_SIZE (12 * 1024 * 1024)
+#define PAGE_COUNT (CHUNK_SIZE / PAGE_SIZE)
+
+static char big_chunk[CHUNK_SIZE];
+
+/* Returns true if every page I starts with I plus BASE. */
+static bool
+pages_are (char base)
+{
+	size_t i;
+
+	for (i = 0; i < PAGE_COUNT; i++)
+		if (big_chunk[i * PAGE_SIZE] != (char) (i + base))
+			return false;
+	return true;
+}
+
+static void
+write_pages (char base)
+{
+	size_t i;
+
+	for (i = 0; i < PAGE_COUNT; i++)
+		big_chunk[i * PAGE_SIZE] = (char) (i + base);
+}
+
+void
+test_main (void)
+{
+	pid_t child;
+
+	write_pages (0);
+	msg ("wrote %d pages", PAGE_COUNT);
+
+	child = fork ("child");
+	if (child == 0) {
+		if (!pages_are (0))
+			exit (1);
+		write_pages (1);
+		exit (pages_are (1) ? 0 : 2);
+	}
+	CHECK (wait (child) == 0, "wait for child");
+	CHECK (pages_are (0), "check parent's pages");
+}
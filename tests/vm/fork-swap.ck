@@ -0,0 +1,12 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(fork-swap) begin
+(fork-swap) wrote 3072 pages
+(fork-swap) wait for child
+(fork-swap) check parent's pages
+(fork-swap) end
+EOF
+pass;
@@ -0,0 +1,80 @@
+/* Fills pages with the same contents and gives the kernel's page
+   merging thread time to put them on one frame, by writing to a
+   file until two of them share a physical address or enough time
+   has passed.  A forked child, then the parent, write to each page;
+   every write must land in that page alone. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define PAGE_SIZE 4096
+#define PAGE_COUNT 16
+#define WAIT_ROUNDS 2000
+#define BLOCK_SIZE 4096
+
+static char pages[PAGE_COUNT * PAGE_SIZE];
+static char block[BLOCK_SIZE];
+
+/* Returns true if page I holds FIRST followed by 'k's. */
+static bool
+page_is (size_t i, char first)
+{
+	const char *mem = pages + i * PAGE_SIZE;
+	size_t j;
+
+	if (mem[0] != first)
+		return false;
+	for (j = 1; j < PAGE_SIZE; j++)
+		if (mem[j] != 'k')
+			return false;
+	return true;
+}
+
+/* Writes I plus BASE to the first byte of every page I, checking
+   that no other page changes. */
+static bool
+write_pages (char base)
+{
+	size_t i, j;
+
+	for (i = 0; i < PAGE_COUNT; i++) {
+		pages[i * PAGE_SIZE] = base + i;
+		for (j = 0; j < PAGE_COUNT; j++)
+			if (!page_is (j, j <= i ? base + j : 'k'))
+				return false;
+	}
+	return true;
+}
+
+void
+test_main (void)
+{
+	int handle, round;
+	pid_t child;
+	size_t i;
+
+	memset (pages, 'k', sizeof pages);
+
+	/* Disk writes block, which lets the merging thread run. */
+	CHECK (create ("scratch", sizeof block), "create \"scratch\"");
+	CHECK ((handle = open ("scratch")) > 1, "open \"scratch\"");
+	for (round = 0; round < WAIT_ROUNDS
+			&& get_phys_addr (pages) != get_phys_addr (pages + PAGE_SIZE); round++) {
+		seek (handle, 0);
+		write (handle, block, sizeof block);
+	}
+	close (handle);
+
+	child = fork ("child");
+	if (child == 0)
+		exit (write_pages ('a') ? 0 : 1);
+	CHECK (wait (child) == 0, "wait for child");
+
+	for (i = 0; i < PAGE_COUNT; i++)
+		if (!page_is (i, 'k'))
+			fail ("page %zu of the parent changed", i);
+	msg ("check parent's pages");
+	CHECK (write_pages ('A'), "write parent's pages");
+}
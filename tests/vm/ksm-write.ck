@@ -0,0 +1,14 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(ksm-write) begin
+(ksm-write) create "scratch"
+(ksm-write) open "scratch"
+(ksm-write) wait for child
+(ksm-write) check parent's pages
+(ksm-write) write parent's pages
+(ksm-write) end
+EOF
+pass;
@@ -0,0 +1,47 @@
+/* Gives advice about a file mapping and an anonymous buffer.
+   MADV_WILLNEED brings pages in and MADV_DONTNEED drops them, after
+   which the file mapping reads back the file and the buffer reads
+   back zeros.  Unknown advice fails. */
+
+#include <stdint.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/vm/sample.inc"
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define PAGE_SIZE 4096
+#define ACTUAL ((char *) 0x10000000)
+
+static char buf[2 * PAGE_SIZE];
+
+void
+test_main (void)
+{
+	/* A page that lies wholly within BUF. */
+	char *anon = (char *) (((uintptr_t) buf + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+	int handle;
+	size_t i;
+
+	CHECK ((handle = open ("sample.txt")) > 1, "open \"sample.txt\"");
+	CHECK (mmap (ACTUAL, PAGE_SIZE, 0, handle, 0) != MAP_FAILED,
+			"mmap \"sample.txt\"");
+	CHECK (get_phys_addr (ACTUAL) == 0, "check if page is not loaded");
+	CHECK (madvise (ACTUAL, PAGE_SIZE, MADV_WILLNEED) == 0, "madvise WILLNEED");
+	CHECK (get_phys_addr (ACTUAL) != 0, "check if page is loaded");
+	CHECK (madvise (ACTUAL, PAGE_SIZE, MADV_DONTNEED) == 0, "madvise DONTNEED");
+	CHECK (get_phys_addr (ACTUAL) == 0, "check if page is not loaded");
+	CHECK (!memcmp (ACTUAL, sample, strlen (sample)), "compare mapped data");
+
+	memset (anon, 'x', PAGE_SIZE);
+	CHECK (madvise (anon, PAGE_SIZE, MADV_DONTNEED) == 0,
+			"madvise DONTNEED on buffer");
+	for (i = 0; i < PAGE_SIZE; i++)
+		if (anon[i] != 0)
+			fail ("byte %zu of dropped page has value %02hhx (should be 0)",
+					i, anon[i]);
+
+	CHECK (madvise (ACTUAL, PAGE_SIZE, 99) == -1, "madvise with bad advice");
+	munmap (ACTUAL);
+	close (handle);
+}
@@ -0,0 +1,19 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(madvise-advice) begin
+(madvise-advice) open "sample.txt"
+(madvise-advice) mmap "sample.txt"
+(madvise-advice) check if page is not loaded
+(madvise-advice) madvise WILLNEED
+(madvise-advice) check if page is loaded
+(madvise-advice) madvise DONTNEED
+(madvise-advice) check if page is not loaded
+(madvise-advice) compare mapped data
+(madvise-advice) madvise DONTNEED on buffer
+(madvise-advice) madvise with bad advice
+(madvise-advice) end
+EOF
+pass;
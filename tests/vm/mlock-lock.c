@@ -0,0 +1,41 @@
+/* Locks an anonymous buffer and a file mapping in memory, and
+   checks that mlock fails on memory that is not mapped. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/vm/sample.inc"
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define PAGE_SIZE 4096
+#define ACTUAL ((char *) 0x10000000)
+
+static char buf[3 * PAGE_SIZE];
+
+void
+test_main (void)
+{
+	int handle;
+	size_t i;
+
+	CHECK (mlock (buf, sizeof buf) == 0, "mlock buffer");
+	for (i = 0; i < sizeof buf; i += PAGE_SIZE)
+		if (get_phys_addr (&buf[i]) == 0)
+			fail ("page %zu of locked buffer is not loaded", i / PAGE_SIZE);
+	memset (buf, 'x', sizeof buf);
+	CHECK (munlock (buf, sizeof buf) == 0, "munlock buffer");
+
+	CHECK ((handle = open ("sample.txt")) > 1, "open \"sample.txt\"");
+	CHECK (mmap (ACTUAL, PAGE_SIZE, 0, handle, 0) != MAP_FAILED,
+			"mmap \"sample.txt\"");
+	CHECK (mlock (ACTUAL, PAGE_SIZE) == 0, "mlock mapping");
+	CHECK (get_phys_addr (ACTUAL) != 0, "check if page is loaded");
+	CHECK (!memcmp (ACTUAL, sample, strlen (sample)), "compare mapped data");
+
+	/* The page after the mapping is not mapped. */
+	CHECK (mlock (ACTUAL, 2 * PAGE_SIZE) == -1, "mlock past end of mapping");
+	CHECK (munlock (ACTUAL, PAGE_SIZE) == 0, "munlock mapping");
+	munmap (ACTUAL);
+	CHECK (mlock (ACTUAL, PAGE_SIZE) == -1, "mlock unmapped memory");
+	close (handle);
+}
@@ -0,0 +1,19 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(mlock-lock) begin
+(mlock-lock) mlock buffer
+(mlock-lock) munlock buffer
+(mlock-lock) open "sample.txt"
+(mlock-lock) mmap "sample.txt"
+(mlock-lock) mlock mapping
+(mlock-lock) check if page is loaded
+(mlock-lock) compare mapped data
+(mlock-lock) mlock past end of mapping
+(mlock-lock) munlock mapping
+(mlock-lock) mlock unmapped memory
+(mlock-lock) end
+EOF
+pass;
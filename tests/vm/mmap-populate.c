@@ -0,0 +1,37 @@
+/* Maps a file with MAP_POPULATE and checks that its pages are
+   loaded before they are touched. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define PAGE_SIZE 4096
+#define PAGE_CNT 3
+#define ACTUAL ((char *) 0x10000000)
+
+void
+test_main (void)
+{
+	char buf[PAGE_SIZE];
+	int handle;
+	size_t i;
+
+	CHECK ((handle = open ("large.txt")) > 1, "open \"large.txt\"");
+	CHECK (mmap (ACTUAL, PAGE_CNT * PAGE_SIZE, MAP_POPULATE, handle, 0)
+			!= MAP_FAILED, "mmap \"large.txt\" with MAP_POPULATE");
+	for (i = 0; i < PAGE_CNT; i++)
+		if (get_phys_addr (ACTUAL + i * PAGE_SIZE) == 0)
+			fail ("page %zu of mapping is not loaded", i);
+	msg ("check if pages are loaded");
+
+	for (i = 0; i < PAGE_CNT; i++) {
+		if (read (handle, buf, PAGE_SIZE) != PAGE_SIZE)
+			fail ("read of page %zu of \"large.txt\" failed", i);
+		if (memcmp (ACTUAL + i * PAGE_SIZE, buf, PAGE_SIZE))
+			fail ("page %zu of mapping has bad data", i);
+	}
+	msg ("compare mapped data");
+	munmap (ACTUAL);
+	close (handle);
+}
@@ -0,0 +1,37 @@
+/* Writes to a file through a mapping and flushes it with msync
+   while it is still mapped, then reads the data back using the read
+   system call to verify.  Conflicting flags are refused. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/vm/sample.inc"
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define PAGE_SIZE 4096
+#define ACTUAL ((char *) 0x10000000)
+
+void
+test_main (void)
+{
+	char buf[1024];
+	int size = strlen (sample);
+	int handle;
+
+	CHECK (create ("sample.txt", size), "create \"sample.txt\"");
+	CHECK ((handle = open ("sample.txt")) > 1, "open \"sample.txt\"");
+	CHECK (mmap (ACTUAL, PAGE_SIZE, 1, handle, 0) != MAP_FAILED,
+			"mmap \"sample.txt\"");
+	memcpy (ACTUAL, sample, size);
+
+	CHECK (msync (ACTUAL, PAGE_SIZE, MS_ASYNC | MS_SYNC) == -1,
+			"msync with MS_ASYNC and MS_SYNC");
+	CHECK (msync (ACTUAL, PAGE_SIZE, MS_SYNC) == 0, "msync with MS_SYNC");
+
+	/* Read back via read(), with the file still mapped. */
+	CHECK (read (handle, buf, size) == size, "read \"sample.txt\"");
+	CHECK (!memcmp (buf, sample, size),
+			"compare read data against written data");
+	munmap (ACTUAL);
+	close (handle);
+}
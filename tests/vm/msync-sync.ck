@@ -0,0 +1,16 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(msync-sync) begin
+(msync-sync) create "sample.txt"
+(msync-sync) open "sample.txt"
+(msync-sync) mmap "sample.txt"
+(msync-sync) msync with MS_ASYNC and MS_SYNC
+(msync-sync) msync with MS_SYNC
+(msync-sync) read "sample.txt"
+(msync-sync) compare read data against written data
+(msync-sync) end
+EOF
+pass;
@@ -0,0 +1,43 @@
+/* Reads a file with the read system call into a buffer that has
+   never been touched and that crosses a page boundary, then into a
+   writable file mapping, and checks the data in both. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/vm/sample.inc"
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define PAGE_SIZE 4096
+#define ACTUAL ((char *) 0x10000000)
+
+static char buf[3 * PAGE_SIZE];
+
+void
+test_main (void)
+{
+	char *dst = buf + 2 * PAGE_SIZE - 100;
+	int size = strlen (sample);
+	int handle, scratch;
+
+	CHECK (get_phys_addr (dst) == 0, "check if buffer is not loaded");
+	CHECK ((handle = open ("sample.txt")) > 1, "open \"sample.txt\"");
+	CHECK (read (handle, dst, size) == size, "read into untouched buffer");
+	CHECK (!memcmp (dst, sample, size), "compare read data");
+
+	CHECK (create ("scratch", PAGE_SIZE), "create \"scratch\"");
+	CHECK ((scratch = open ("scratch")) > 1, "open \"scratch\"");
+	CHECK (mmap (ACTUAL, PAGE_SIZE, 1, scratch, 0) != MAP_FAILED,
+			"mmap \"scratch\"");
+	seek (handle, 0);
+	CHECK (read (handle, ACTUAL, size) == size, "read into mapping");
+	CHECK (!memcmp (ACTUAL, sample, size), "compare mapped data");
+	munmap (ACTUAL);
+
+	/* The data read into the mapping reached the file. */
+	memset (buf, 0, sizeof buf);
+	CHECK (read (scratch, buf, size) == size, "read \"scratch\"");
+	CHECK (!memcmp (buf, sample, size), "compare file data");
+	close (scratch);
+	close (handle);
+}
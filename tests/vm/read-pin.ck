@@ -0,0 +1,20 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(read-pin) begin
+(read-pin) check if buffer is not loaded
+(read-pin) open "sample.txt"
+(read-pin) read into untouched buffer
+(read-pin) compare read data
+(read-pin) create "scratch"
+(read-pin) open "scratch"
+(read-pin) mmap "scratch"
+(read-pin) read into mapping
+(read-pin) compare mapped data
+(read-pin) read "scratch"
+(read-pin) compare file data
+(read-pin) end
+EOF
+pass;
@@ -0,0 +1,53 @@
+/* Writes three bytes to each page of a buffer larger than memory,
+   so that most of it goes out to swap, then checks the buffer
+   front to back, back to front and front to back again.  The
+   forward passes bring neighbouring pages in ahead of the faults;
+   the backward pass makes that readahead useless.  Every page has
+   to read back what was written, whichever way it came in. */
+
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define PAGE_SIZE 4096
+#define CHUNK_SIZE (16 * 1024 * 1024)
+#define PAGE_COUNT (CHUNK_SIZE / PAGE_SIZE)
+
+static char big_chunk[CHUNK_SIZE];
+
+static void
+check_page (size_t i)
+{
+	char *mem = big_chunk + i * PAGE_SIZE;
+
+	if (mem[0] != (char) i || mem[PAGE_SIZE / 2] != (char) (i ^ 0x5a)
+			|| mem[PAGE_SIZE - 1] != (char) ~i)
+		fail ("data is inconsistent in page %zu", i);
+}
+
+void
+test_main (void)
+{
+	char *mem;
+	size_t i;
+
+	for (i = 0; i < PAGE_COUNT; i++) {
+		mem = big_chunk + i * PAGE_SIZE;
+		mem[0] = (char) i;
+		mem[PAGE_SIZE / 2] = (char) (i ^ 0x5a);
+		mem[PAGE_SIZE - 1] = (char) ~i;
+	}
+	msg ("wrote %d pages", PAGE_COUNT);
+
+	for (i = 0; i < PAGE_COUNT; i++)
+		check_page (i);
+	msg ("checked forward");
+
+	for (i = PAGE_COUNT; i-- > 0; )
+		check_page (i);
+	msg ("checked backward");
+
+	for (i = 0; i < PAGE_COUNT; i++)
+		check_page (i);
+	msg ("checked forward again");
+}
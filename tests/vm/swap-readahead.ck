@@ -0,0 +1,13 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(swap-readahead) begin
+(swap-readahead) wrote 4096 pages
+(swap-readahead) checked forward
+(swap-readahead) checked backward
+(swap-readahead) checked forward again
+(swap-readahead) end
+EOF
+pass;
@@ -0,0 +1,69 @@
+/* Fills a buffer larger than memory with three kinds of pages:
+   pages of one repeated byte, pages that compress well, and random
+   pages that do not compress at all, then checks every byte.  The
+   kernel runs with a small compressed swap pool, so pages go to the
+   pool, are spilled from it to the disk and come back from both. */
+
+#include <stdint.h>
+#include <syscall.h>
+#include "tests/arc4.h"
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define PAGE_SIZE 4096
+#define CHUNK_SIZE (12 * 1024 * 1024)
+#define PAGE_COUNT (CHUNK_SIZE / PAGE_SIZE)
+
+static char big_chunk[CHUNK_SIZE];
+
+/* Scrambles page I with a key of its own.  Scrambling it twice
+   gives back what it was. */
+static void
+scramble_page (size_t i)
+{
+	struct arc4 arc4;
+
+	arc4_init (&arc4, &i, sizeof i);
+	arc4_crypt (&arc4, big_chunk + i * PAGE_SIZE, PAGE_SIZE);
+}
+
+/* Returns byte J of page I as it should be, leaving aside the
+   scrambling of random pages. */
+static char
+expected_byte (size_t i, size_t j)
+{
+	switch (i % 3) {
+	case 0:
+		return (char) (i | 1);
+	case 1:
+		return (char) (i + j / 64);
+	default:
+		return 0;
+	}
+}
+
+void
+test_main (void)
+{
+	char *mem;
+	size_t i, j;
+
+	for (i = 0; i < PAGE_COUNT; i++) {
+		mem = big_chunk + i * PAGE_SIZE;
+		for (j = 0; j < PAGE_SIZE; j++)
+			mem[j] = expected_byte (i, j);
+		if (i % 3 == 2)
+			scramble_page (i);
+	}
+	msg ("wrote %d pages", PAGE_COUNT);
+
+	for (i = 0; i < PAGE_COUNT; i++) {
+		mem = big_chunk + i * PAGE_SIZE;
+		if (i % 3 == 2)
+			scramble_page (i);
+		for (j = 0; j < PAGE_SIZE; j++)
+			if (mem[j] != expected_byte (i, j))
+				fail ("byte %zu of page %zu is inconsistent", j, i);
+	}
+	msg ("checked %d pages", PAGE_COUNT);
+}
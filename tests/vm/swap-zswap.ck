@@ -0,0 +1,11 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(swap-zswap) begin
+(swap-zswap) wrote 3072 pages
+(swap-zswap) checked 3072 pages
+(swap-zswap) end
+EOF
+pass;
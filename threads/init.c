@@ -8,6 +8,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "intrinsic.h"
 #include "devices/kbd.h"
 #include "devices/input.h"
 #include "devices/serial.h"
@@ -20,6 +21,7 @@
 #include "threads/mmu.h"
 #include "threads/palloc.h"
 #include "threads/pte.h"
+#include "threads/slab.h"
 #include "threads/thread.h"
 #ifdef USERPROG
 #include "userprog/process.h"
@@ -31,6 +33,7 @@
 #include "tests/threads/tests.h"
 #ifdef VM
 #include "vm/vm.h"
+#include "vm/zswap.h"
 #endif
 #ifdef FILESYS
 #include "devices/disk.h"
@@ -85,6 +88,7 @@ main (void) {
 	/* Initialize memory system. */
 	mem_end = palloc_init ();
 	malloc_init ();
+	kmem_init ();
 	paging_init (mem_end);
 
 #ifdef USERPROG
@@ -165,6 +169,11 @@ paging_init (uint64_t mem_end) {
 
 	// reload cr3
 	pml4_activate(0);
+	pml4_init_pcid();
+
+	// Make kernel writes fault on read-only user pages as well, so that
+	// copy-on-write and the shared zero page also work for syscalls.
+	lcr0 (rcr0 () | CR0_WP);
 }
 
 /* Breaks the kernel command line into words and returns them as
@@ -226,6 +235,22 @@ parse_options (char **argv) {
 			user_page_limit = atoi (value);
 		else if (!strcmp (name, "-threads-tests"))
 			thread_tests = true;
+#endif
+#ifdef VM
+		else if (!strcmp (name, "-vm-low"))
+			vm_low_watermark = atoi (value);
+		else if (!strcmp (name, "-vm-high"))
+			vm_high_watermark = atoi (value);
+		else if (!strcmp (name, "-fault-around"))
+			vm_fault_around = atoi (value);
+		else if (!strcmp (name, "-zswap"))
+			zswap_pool_pages = atoi (value);
+		else if (!strcmp (name, "-no-huge"))
+			vm_huge_pages = false;
+		else if (!strcmp (name, "-writeback"))
+			vm_writeback_secs = atoi (value);
+		else if (!strcmp (name, "-ksm"))
+			vm_ksm_pages = atoi (value);
 #endif
 		else
 			PANIC ("unknown option `%s' (use -h for help)", name);
@@ -328,6 +353,16 @@ usage (void) {
 			"  -mlfqs             Use multi-level feedback queue scheduler.\n"
 #ifdef USERPROG
 			"  -ul=COUNT          Limit user memory to COUNT pages.\n"
+#endif
+#ifdef VM
+			"  -vm-low=COUNT      Start reclaiming below COUNT free user pages.\n"
+			"  -vm-high=COUNT     Stop reclaiming at COUNT free user pages.\n"
+			"  -fault-around=COUNT\n"
+			"                     Also populate neighbours in blocks of COUNT pages.\n"
+			"  -zswap=COUNT       Keep up to COUNT pages of compressed swap in RAM.\n"
+			"  -no-huge           Map everything with 4 KB pages.\n"
+			"  -writeback=SECS    Write back dirty mmaps every SECS seconds, 0 for never.\n"
+			"  -ksm=COUNT         Merge identical anonymous pages, scanning COUNT per 100 ms.\n"
 #endif
 			);
 	power_off ();
@@ -354,6 +389,8 @@ static void
 print_stats (void) {
 	timer_print_stats ();
 	thread_print_stats ();
+	palloc_print_stats ();
+	kmem_print_stats ();
 #ifdef FILESYS
 	disk_print_stats ();
 #endif
@@ -361,5 +398,9 @@ print_stats (void) {
 	kbd_print_stats ();
 #ifdef USERPROG
 	exception_print_stats ();
+	pml4_print_stats ();
+#endif
+#ifdef VM
+	vm_print_stats ();
 #endif
 }
@@ -1,18 +1,195 @@
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdio.h>
 #include <string.h>
 #include "threads/init.h"
 #include "threads/pte.h"
 #include "threads/palloc.h"
 #include "threads/thread.h"
+#include "threads/interrupt.h"
 #include "threads/mmu.h"
 #include "intrinsic.h"
 
+/* Address space switches. */
+static long long cr3_loads;		/* CR3 writes. */
+static long long cr3_skips;		/* Switches to the space already loaded. */
+
+/* Process-context identifiers, used when the CPU has them.  Each slot
+ * tags the TLB entries of one page map, so that they survive
+ * switching to other address spaces; slot 0 is the kernel's.  Slots
+ * are handed out round robin.  A page map has its entries flushed
+ * when it is first loaded under a slot, and when it was changed while
+ * it was not loaded, since invlpg only reaches the current PCID.
+ * Accessed with interrupts off. */
+#define PCID_CNT 64
+static bool pcid_enabled;
+static unsigned pcid_next = 1;
+static struct pcid_slot {
+	uint64_t *pml4;
+	bool stale;
+} pcid_slots[PCID_CNT];
+
+/* Returns the slot of PML4, or -1. */
+static int
+pcid_find (uint64_t *pml4) {
+	for (int i = 0; i < PCID_CNT; i++)
+		if (pcid_slots[i].pml4 == pml4)
+			return i;
+	return -1;
+}
+
+/* Returns the PCID bits of the CR3 value that loads PML4, taking a
+ * slot for it if it has none. */
+static uint64_t
+pcid_assign (uint64_t *pml4) {
+	int i = pcid_find (pml4);
+
+	if (i < 0) {
+		i = pcid_next;
+		pcid_next = pcid_next % (PCID_CNT - 1) + 1;
+		pcid_slots[i].pml4 = pml4;
+		pcid_slots[i].stale = true;
+	}
+	if (pcid_slots[i].stale) {
+		pcid_slots[i].stale = false;
+		return i;
+	}
+	return i | CR3_NOFLUSH;
+}
+
+/* Returns true if PML4 is the page map the CPU is using. */
+static bool
+pml4_is_active (uint64_t *pml4) {
+	return PTE_ADDR (rcr3 ()) == vtop (pml4);
+}
+
+/* TLB flushes. */
+static long long tlb_page_flushes;	/* Pages dropped with invlpg. */
+static long long tlb_full_flushes;	/* Whole TLB flushes of a batch. */
+static long long tlb_tables_freed;	/* Page tables a batch left empty. */
+
+/* No 2 MB block in mmu_gather.pt_base yet. */
+#define NO_BLOCK UINT64_MAX
+
+/* Has the whole TLB of PML4, which is not loaded, flushed at its next
+ * load. */
+static void
+pml4_mark_stale (uint64_t *pml4) {
+	enum intr_level old_level;
+	int i;
+
+	if (!pcid_enabled)
+		return;
+	old_level = intr_disable ();
+	if ((i = pcid_find (pml4)) >= 0)
+		pcid_slots[i].stale = true;
+	intr_set_level (old_level);
+}
+
+/* Returns the batch of the running thread that gathers the changes
+ * to PML4, or NULL. */
+static struct mmu_gather *
+gather_of (uint64_t *pml4 UNUSED) {
+#ifdef USERPROG
+	struct mmu_gather *tlb = thread_current ()->tlb;
+
+	if (tlb != NULL && tlb->pml4 == pml4)
+		return tlb;
+#endif
+	return NULL;
+}
+
+static void mmu_gather_reap (struct mmu_gather *tlb, uint64_t base);
+
+/* Records that the entry of VA changed in TLB's page map. */
+static void
+gather_add (struct mmu_gather *tlb, const void *va) {
+	if (tlb->cnt < MMU_GATHER_PAGES)
+		tlb->pages[tlb->cnt] = va;
+	tlb->cnt++;
+}
+
+/* Drops the TLB entry of VA in PML4 after its page table entry
+ * changed, or the whole TLB of PML4 at its next load if it is not the
+ * one loaded now.  Within a batch, only records VA. */
+static void
+pml4_invalidate (uint64_t *pml4, const void *va) {
+	struct mmu_gather *tlb = gather_of (pml4);
+
+	if (tlb != NULL)
+		gather_add (tlb, va);
+	else if (pml4_is_active (pml4)) {
+		invlpg ((uint64_t) va);
+		tlb_page_flushes++;
+	} else
+		pml4_mark_stale (pml4);
+}
+
+/* Replaces the 2 MB mapping in *PDE by a page table of 512 entries
+ * that map the same memory with the same flags.  The TLB needs no
+ * flush: the translations do not change, and invlpg of any of the
+ * pages drops the large entry too.  Returns false if out of memory. */
+static bool
+pde_split (uint64_t *pde, enum palloc_flags flags) {
+	uint64_t *pt = palloc_get_page (flags);
+	uint64_t pa = PTE_ADDR (*pde), pte_flags = *pde & PTE_FLAGS & ~PTE_PS;
+
+	if (pt == NULL)
+		return false;
+	for (unsigned i = 0; i < PGSIZE / sizeof(uint64_t *); i++)
+		pt[i] = (pa + i * PGSIZE) | pte_flags;
+	*pde = vtop (pt) | PTE_U | PTE_W | PTE_P;
+	return true;
+}
+
+/* Returns the page directory entry of VA in PML4.  Missing
+ * directories are created if CREATE is true; otherwise, or if that
+ * fails, returns NULL. */
+static uint64_t *
+pde_walk (uint64_t *pml4, const uint64_t va, bool create) {
+	uint64_t *pdpe, *pdp;
+
+	if (!(pml4[PML4 (va)] & PTE_P)) {
+		if (!create || (pdpe = palloc_get_page (PAL_ZERO)) == NULL)
+			return NULL;
+		pml4[PML4 (va)] = vtop (pdpe) | PTE_U | PTE_W | PTE_P;
+	}
+	pdpe = ptov (PTE_ADDR (pml4[PML4 (va)]));
+	if (!(pdpe[PDPE (va)] & PTE_P)) {
+		if (!create || (pdp = palloc_get_page (PAL_ZERO)) == NULL)
+			return NULL;
+		pdpe[PDPE (va)] = vtop (pdp) | PTE_U | PTE_W | PTE_P;
+	}
+	pdp = ptov (PTE_ADDR (pdpe[PDPE (va)]));
+	return &pdp[PDX (va)];
+}
+
+/* Splits the 2 MB mapping that holds VA in PML4, if any, so that the
+ * entry of VA alone can be changed.  Returns false, leaving the
+ * mapping as it is, if there is no memory for the page table. */
+static bool
+pml4_split (uint64_t *pml4, const void *va) {
+	uint64_t *pde = pde_walk (pml4, (uint64_t) va, false);
+
+	if (pde != NULL && (*pde & PTE_P) && (*pde & PTE_PS))
+		return pde_split (pde, PAL_ZERO);
+	return true;
+}
+
+/* Walks the page table of PDP.  A 2 MB mapping is split when an entry
+ * is to be created; otherwise its directory entry, which has the
+ * same present, dirty and accessed bits, is returned in its place. */
 static uint64_t *
 pgdir_walk (uint64_t *pdp, const uint64_t va, int create) {
 	int idx = PDX (va);
 	if (pdp) {
 		uint64_t *pte = (uint64_t *) pdp[idx];
+		if (((uint64_t) pte & PTE_P) && ((uint64_t) pte & PTE_PS)) {
+			if (!create)
+				return &pdp[idx];
+			if (!pde_split (&pdp[idx], PAL_ZERO))
+				return NULL;
+		}
 		if (!((uint64_t) pte & PTE_P)) {
 			if (create) {
 				uint64_t *new_page = palloc_get_page (PAL_ZERO);
@@ -122,7 +299,7 @@ pgdir_for_each (uint64_t *pdp, pte_for_each_func *func, void *aux,
 		unsigned pml4_index, unsigned pdp_index) {
 	for (unsigned i = 0; i < PGSIZE / sizeof(uint64_t *); i++) {
 		uint64_t *pte = ptov((uint64_t *) pdp[i]);
-		if (((uint64_t) pte) & PTE_P)
+		if ((((uint64_t) pte) & PTE_P) && !(pdp[i] & PTE_PS))
 			if (!pt_for_each ((uint64_t *) PTE_ADDR (pte), func, aux,
 					pml4_index, pdp_index, i))
 				return false;
@@ -169,7 +346,8 @@ static void
 pgdir_destroy (uint64_t *pdp) {
 	for (unsigned i = 0; i < PGSIZE / sizeof(uint64_t *); i++) {
 		uint64_t *pte = ptov((uint64_t *) pdp[i]);
-		if (((uint64_t) pte) & PTE_P)
+		/* 2 MB mappings belong to the VM, which frees their frames. */
+		if ((((uint64_t) pte) & PTE_P) && !(pdp[i] & PTE_PS))
 			pt_destroy (PTE_ADDR (pte));
 	}
 	palloc_free_page ((void *) pdp);
@@ -188,9 +366,19 @@ pdpe_destroy (uint64_t *pdpe) {
 /* Destroys pml4e, freeing all the pages it references. */
 void
 pml4_destroy (uint64_t *pml4) {
+	enum intr_level old_level;
+	int i;
+
 	if (pml4 == NULL)
 		return;
 	ASSERT (pml4 != base_pml4);
+	ASSERT (!pml4_is_active (pml4));
+
+	/* A page map allocated here later must not find our entries. */
+	old_level = intr_disable ();
+	if ((i = pcid_find (pml4)) >= 0)
+		pcid_slots[i].pml4 = NULL;
+	intr_set_level (old_level);
 
 	/* if PML4 (vaddr) >= 1, it's kernel space by define. */
 	uint64_t *pdpe = ptov ((uint64_t *) pml4[0]);
@@ -200,10 +388,49 @@ pml4_destroy (uint64_t *pml4) {
 }
 
 /* Loads page directory PD into the CPU's page directory base
- * register. */
+ * register.  Nothing is done if it is loaded already, so that the
+ * TLB survives switches within an address space. */
 void
 pml4_activate (uint64_t *pml4) {
-	lcr3 (vtop (pml4 ? pml4 : base_pml4));
+	enum intr_level old_level;
+	uint64_t cr3;
+
+	if (pml4 == NULL)
+		pml4 = base_pml4;
+	cr3 = vtop (pml4);
+	if (pml4_is_active (pml4)) {
+		cr3_skips++;
+		return;
+	}
+	cr3_loads++;
+	if (pcid_enabled) {
+		old_level = intr_disable ();
+		cr3 |= pcid_assign (pml4);
+		intr_set_level (old_level);
+	}
+	lcr3 (cr3);
+}
+
+/* Turns on process-context identifiers if the CPU has them.  Must be
+ * called with the kernel page map loaded. */
+void
+pml4_init_pcid (void) {
+	if (!(cpuid_ecx (1) & (1 << 17)))
+		return;
+	ASSERT (pml4_is_active (base_pml4));
+	pcid_slots[0].pml4 = base_pml4;
+	lcr4 (rcr4 () | CR4_PCIDE);
+	pcid_enabled = true;
+}
+
+/* Prints address space switch and TLB statistics. */
+void
+pml4_print_stats (void) {
+	printf ("Address spaces: %lld CR3 loads, %lld skipped, PCID %s\n",
+			cr3_loads, cr3_skips, pcid_enabled ? "on" : "off");
+	printf ("TLB: %lld pages invalidated, %lld full flushes, "
+			"%lld page tables freed\n",
+			tlb_page_flushes, tlb_full_flushes, tlb_tables_freed);
 }
 
 /* Looks up the physical address that corresponds to user virtual
@@ -216,6 +443,8 @@ pml4_get_page (uint64_t *pml4, const void *uaddr) {
 
 	uint64_t *pte = pml4e_walk (pml4, (uint64_t) uaddr, 0);
 
+	if (pte && (*pte & PTE_P) && (*pte & PTE_PS))
+		return ptov (PTE_ADDR (*pte)) + ((uint64_t) uaddr & (HUGE_PGSIZE - 1));
 	if (pte && (*pte & PTE_P))
 		return ptov (PTE_ADDR (*pte)) + pg_ofs (uaddr);
 	return NULL;
@@ -237,29 +466,111 @@ pml4_set_page (uint64_t *pml4, void *upage, void *kpage, bool rw) {
 	ASSERT (pml4 != base_pml4);
 
 	uint64_t *pte = pml4e_walk (pml4, (uint64_t) upage, 1);
+	bool was_present;
 
-	if (pte)
+	if (pte) {
+		was_present = (*pte & PTE_P) != 0;
 		*pte = vtop (kpage) | PTE_P | (rw ? PTE_W : 0) | PTE_U;
+		if (was_present)
+			pml4_invalidate (pml4, upage);
+	}
 	return pte != NULL;
 }
 
+/* Maps the 2 MB of user virtual memory at UPAGE in PML4 to the
+ * physically contiguous memory at kernel virtual address KPAGE with a
+ * single page directory entry.  Both must be 2 MB aligned, and none
+ * of the pages of UPAGE may be mapped yet.  Returns false if one is,
+ * or if memory allocation fails; the caller then maps the pages one
+ * by one. */
+bool
+pml4_set_huge_page (uint64_t *pml4, void *upage, void *kpage, bool rw) {
+	uint64_t *pde, *pt;
+
+	ASSERT (((uint64_t) upage & (HUGE_PGSIZE - 1)) == 0);
+	ASSERT ((vtop (kpage) & (HUGE_PGSIZE - 1)) == 0);
+	ASSERT (is_user_vaddr (upage));
+	ASSERT (pml4 != base_pml4);
+
+	pde = pde_walk (pml4, (uint64_t) upage, true);
+	if (pde == NULL)
+		return false;
+	if (*pde & PTE_P) {
+		if (*pde & PTE_PS)
+			return false;
+		/* A page table left over from earlier mappings may go if it
+		 * maps nothing any more. */
+		pt = ptov (PTE_ADDR (*pde));
+		for (unsigned i = 0; i < PGSIZE / sizeof(uint64_t *); i++)
+			if (pt[i] & PTE_P)
+				return false;
+		palloc_free_page (pt);
+	}
+	*pde = vtop (kpage) | PTE_PS | PTE_P | (rw ? PTE_W : 0) | PTE_U;
+	/* The CPU may still cache the directory entry of the old table. */
+	pml4_invalidate (pml4, upage);
+	return true;
+}
+
 /* Marks user virtual page UPAGE "not present" in page
  * directory PD.  Later accesses to the page will fault.  Other
  * bits in the page table entry are preserved.
- * UPAGE need not be mapped. */
-void
+ * UPAGE need not be mapped.  Returns false, changing nothing, if
+ * UPAGE lies in a 2 MB mapping that cannot be split for lack of
+ * memory; see pml4_clear_huge_page(). */
+bool
 pml4_clear_page (uint64_t *pml4, void *upage) {
-	uint64_t *pte;
+	struct mmu_gather *tlb;
+	enum intr_level old_level;
+	uint64_t *pte, base;
 	ASSERT (pg_ofs (upage) == 0);
 	ASSERT (is_user_vaddr (upage));
 
+	if (!pml4_split (pml4, upage))
+		return false;
+	/* Not while a batch of the owner frees the page table. */
+	old_level = intr_disable ();
 	pte = pml4e_walk (pml4, (uint64_t) upage, false);
 
 	if (pte != NULL && (*pte & PTE_P) != 0) {
 		*pte &= ~PTE_P;
-		if (rcr3 () == vtop (pml4))
-			invlpg ((uint64_t) upage);
+		pml4_invalidate (pml4, upage);
+	}
+	intr_set_level (old_level);
+
+	/* A batch checks each page table it cleared pages in once it
+	 * moves on to the next one. */
+	tlb = gather_of (pml4);
+	base = (uint64_t) upage & ~(uint64_t) (HUGE_PGSIZE - 1);
+	if (tlb != NULL && tlb->pt_base != base) {
+		if (tlb->pt_base != NO_BLOCK)
+			mmu_gather_reap (tlb, tlb->pt_base);
+		tlb->pt_base = base;
 	}
+	return true;
+}
+
+/* Unmaps the whole 2 MB mapping that holds UPAGE in PML4, for when
+ * the entry of UPAGE alone cannot be split off.  Returns the kernel
+ * virtual address the block was mapped to and stores in *DIRTY
+ * whether it was written, or returns NULL if UPAGE does not lie in a
+ * 2 MB mapping. */
+void *
+pml4_clear_huge_page (uint64_t *pml4, void *upage, bool *dirty) {
+	enum intr_level old_level;
+	uint64_t *pde;
+	void *kva = NULL;
+
+	old_level = intr_disable ();
+	pde = pde_walk (pml4, (uint64_t) upage, false);
+	if (pde != NULL && (*pde & PTE_P) && (*pde & PTE_PS)) {
+		kva = ptov (PTE_ADDR (*pde));
+		*dirty = (*pde & PTE_D) != 0;
+		*pde = 0;
+		pml4_invalidate (pml4, upage);
+	}
+	intr_set_level (old_level);
+	return kva;
 }
 
 /* Returns true if the PTE for virtual page VPAGE in PML4 is dirty,
@@ -272,19 +583,32 @@ pml4_is_dirty (uint64_t *pml4, const void *vpage) {
 	return pte != NULL && (*pte & PTE_D) != 0;
 }
 
+/* Returns true if the PTE for virtual page VPAGE in PML4 is present
+ * and writable. */
+bool
+pml4_is_writable (uint64_t *pml4, const void *vpage) {
+	uint64_t *pte = pml4e_walk (pml4, (uint64_t) vpage, false);
+	return pte != NULL && (*pte & PTE_P) && (*pte & PTE_W);
+}
+
 /* Set the dirty bit to DIRTY in the PTE for virtual page VPAGE
- * in PML4. */
+ * in PML4.  If VPAGE lies in a 2 MB mapping that cannot be split,
+ * the bit of the whole mapping may be set but is never cleared, since
+ * the other pages may have been written. */
 void
 pml4_set_dirty (uint64_t *pml4, const void *vpage, bool dirty) {
-	uint64_t *pte = pml4e_walk (pml4, (uint64_t) vpage, false);
+	uint64_t *pte;
+
+	if (!pml4_split (pml4, vpage) && !dirty)
+		return;
+	pte = pml4e_walk (pml4, (uint64_t) vpage, false);
 	if (pte) {
 		if (dirty)
 			*pte |= PTE_D;
 		else
 			*pte &= ~(uint32_t) PTE_D;
 
-		if (rcr3 () == vtop (pml4))
-			invlpg ((uint64_t) vpage);
+		pml4_invalidate (pml4, vpage);
 	}
 }
 
@@ -299,17 +623,110 @@ pml4_is_accessed (uint64_t *pml4, const void *vpage) {
 }
 
 /* Sets the accessed bit to ACCESSED in the PTE for virtual page
-   VPAGE in PD. */
+   VPAGE in PD.  If VPAGE lies in a 2 MB mapping that cannot be
+   split, the bit of the whole mapping is changed instead. */
 void
 pml4_set_accessed (uint64_t *pml4, const void *vpage, bool accessed) {
-	uint64_t *pte = pml4e_walk (pml4, (uint64_t) vpage, false);
+	uint64_t *pte;
+
+	pml4_split (pml4, vpage);
+	pte = pml4e_walk (pml4, (uint64_t) vpage, false);
 	if (pte) {
 		if (accessed)
 			*pte |= PTE_A;
 		else
 			*pte &= ~(uint32_t) PTE_A;
 
-		if (rcr3 () == vtop (pml4))
-			invlpg ((uint64_t) vpage);
+		pml4_invalidate (pml4, vpage);
 	}
 }
+
+/* Drops the TLB entries of the pages changed in TLB so far and frees
+ * the page tables it unlinked.  Any invlpg also drops the cached
+ * directory entries that pointed to those tables. */
+static void
+mmu_gather_flush (struct mmu_gather *tlb) {
+	size_t i;
+
+	if (tlb->cnt > 0) {
+		if (!pml4_is_active (tlb->pml4))
+			pml4_mark_stale (tlb->pml4);
+		else if (tlb->cnt > MMU_GATHER_PAGES) {
+			/* Writing CR3 flushes the entries of its PCID. */
+			lcr3 (rcr3 ());
+			tlb_full_flushes++;
+		} else {
+			for (i = 0; i < tlb->cnt; i++)
+				invlpg ((uint64_t) tlb->pages[i]);
+			tlb_page_flushes += tlb->cnt;
+		}
+	}
+	for (i = 0; i < tlb->table_cnt; i++)
+		palloc_free_page (tlb->tables[i]);
+	tlb_tables_freed += tlb->table_cnt;
+	tlb->cnt = 0;
+	tlb->table_cnt = 0;
+}
+
+/* Unlinks the page table of the 2 MB block at BASE from TLB's page
+ * map if it maps nothing any more, and the page directory above it
+ * if that is left empty too.  They are freed by the next flush. */
+static void
+mmu_gather_reap (struct mmu_gather *tlb, uint64_t base) {
+	uint64_t *pml4 = tlb->pml4, *pdpe, *pde, *pd, *pt;
+	enum intr_level old_level;
+	unsigned i;
+
+	/* The directories next to the kernel's are shared by every page
+	 * map. */
+	if (pml4[PML4 (base)] == base_pml4[PML4 (base)])
+		return;
+	if (tlb->table_cnt + 2 > MMU_GATHER_TABLES)
+		mmu_gather_flush (tlb);
+
+	old_level = intr_disable ();
+	pde = pde_walk (pml4, base, false);
+	if (pde == NULL || !(*pde & PTE_P) || (*pde & PTE_PS))
+		goto done;
+	pt = ptov (PTE_ADDR (*pde));
+	for (i = 0; i < PGSIZE / sizeof(uint64_t *); i++)
+		if (pt[i] & PTE_P)
+			goto done;
+	*pde = 0;
+	tlb->tables[tlb->table_cnt++] = pt;
+	gather_add (tlb, (void *) base);
+
+	pd = pg_round_down (pde);
+	for (i = 0; i < PGSIZE / sizeof(uint64_t *); i++)
+		if (pd[i] & PTE_P)
+			goto done;
+	pdpe = ptov (PTE_ADDR (pml4[PML4 (base)]));
+	pdpe[PDPE (base)] = 0;
+	tlb->tables[tlb->table_cnt++] = pd;
+done:
+	intr_set_level (old_level);
+}
+
+/* Starts a batch of changes to PML4 by the running thread. */
+void
+mmu_gather_start (struct mmu_gather *tlb, uint64_t *pml4) {
+	tlb->pml4 = pml4;
+	tlb->cnt = 0;
+	tlb->table_cnt = 0;
+	tlb->pt_base = NO_BLOCK;
+#ifdef USERPROG
+	ASSERT (thread_current ()->tlb == NULL);
+	thread_current ()->tlb = tlb;
+#endif
+}
+
+/* Ends the batch TLB, flushing what it changed. */
+void
+mmu_gather_finish (struct mmu_gather *tlb) {
+	if (tlb->pt_base != NO_BLOCK)
+		mmu_gather_reap (tlb, tlb->pt_base);
+#ifdef USERPROG
+	thread_current ()->tlb = NULL;
+#endif
+	mmu_gather_flush (tlb);
+}
@@ -2,14 +2,15 @@
 #include <bitmap.h>
 #include <debug.h>
 #include <inttypes.h>
+#include <list.h>
 #include <round.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include "threads/init.h"
+#include "threads/interrupt.h"
 #include "threads/loader.h"
-#include "threads/synch.h"
 #include "threads/vaddr.h"
 
 /* Page allocator.  Hands out memory in page-size (or
@@ -26,13 +27,53 @@
    half to the user pool.  That should be huge overkill for the
    kernel pool, but that's just fine for demonstration purposes. */
 
-/* A memory pool. */
+/* Largest block the buddy allocator keeps, as a power of two of
+   pages.  Blocks of order 9 are 2 MB and physically aligned, so they
+   can be mapped with large pages. */
+#define MAX_ORDER 10
+#define NO_ORDER 0xff
+
+/* Number of free pages per pool that the idle thread keeps zeroed
+   for PAL_ZERO requests. */
+#define ZERO_CACHE_PAGES 64
+
+/* Buddy allocator state of one page. */
+struct buddy_page {
+	struct list_elem elem;          /* Free list element. */
+	uint8_t order;                  /* Order of the free block this page
+	                                   heads, or NO_ORDER. */
+};
+
+/* A memory pool.
+
+   Free pages are kept in binary buddy free lists: a free block of
+   order K is 2**K pages whose physical page number is a multiple of
+   2**K.  Freeing a block merges it with its buddy, the other half of
+   the block of order K + 1, while that is free too.
+
+   The lists are changed with interrupts off rather than under a
+   lock, since pages are also freed by the scheduler.  Every
+   operation is O(MAX_ORDER), except for requests larger than the
+   largest block, which fall back to scanning used_map. */
 struct pool {
-	struct lock lock;               /* Mutual exclusion. */
 	struct bitmap *used_map;        /* Bitmap of free pages. */
 	uint8_t *base;                  /* Base of pool. */
+	struct buddy_page *pages;       /* Buddy state of each page. */
+	struct list free_list[MAX_ORDER + 1];  /* Free blocks by order. */
+	size_t shift;                   /* Physical page number of BASE,
+	                                   modulo the largest block. */
+	size_t free_cnt;                /* Pages in the free lists. */
+
+	/* Zeroed pages, taken off the free lists by the idle thread. */
+	size_t zeroed[ZERO_CACHE_PAGES];
+	size_t zero_cnt;
 };
 
+/* Statistics. */
+static long long zero_requests;   /* PAL_ZERO pages asked for. */
+static long long zero_hits;       /* ...that were already zero. */
+static long long idle_zeroed;     /* Pages zeroed by the idle thread. */
+
 /* Two pools: one for kernel data, one for user pages. */
 static struct pool kernel_pool, user_pool;
 
@@ -41,6 +82,7 @@ size_t user_page_limit = SIZE_MAX;
 static void
 init_pool (struct pool *p, void **bm_base, uint64_t start, uint64_t end);
 
+static void init_free_lists (struct pool *p);
 static bool page_from_pool (const struct pool *, void *page);
 
 /* multiboot info */
@@ -232,6 +274,8 @@ split:
 			}
 		}
 	}
+	init_free_lists (&kernel_pool);
+	init_free_lists (&user_pool);
 }
 
 /* Initializes the page allocator and get the memory size */
@@ -253,6 +297,213 @@ palloc_init (void) {
 	return ext_mem.end;
 }
 
+/* Returns the number of pages in a block of ORDER. */
+static size_t
+block_pages (int order) {
+	return (size_t) 1 << order;
+}
+
+/* Returns the smallest order whose blocks hold PAGE_CNT pages. */
+static int
+order_for (size_t page_cnt) {
+	int order = 0;
+
+	while (block_pages (order) < page_cnt)
+		order++;
+	return order;
+}
+
+/* Puts the free block of ORDER at PAGE_IDX on POOL's free list. */
+static void
+block_push (struct pool *pool, size_t page_idx, int order) {
+	pool->pages[page_idx].order = order;
+	list_push_front (&pool->free_list[order], &pool->pages[page_idx].elem);
+}
+
+/* Takes the free block at PAGE_IDX off POOL's free list. */
+static void
+block_remove (struct pool *pool, size_t page_idx) {
+	list_remove (&pool->pages[page_idx].elem);
+	pool->pages[page_idx].order = NO_ORDER;
+}
+
+/* Returns the index of the buddy of the block of ORDER at PAGE_IDX,
+   or BITMAP_ERROR if the buddy is not entirely inside POOL. */
+static size_t
+buddy_of (const struct pool *pool, size_t page_idx, int order) {
+	size_t buddy = (page_idx + pool->shift) ^ block_pages (order);
+
+	if (buddy < pool->shift)
+		return BITMAP_ERROR;
+	buddy -= pool->shift;
+	if (buddy + block_pages (order) > bitmap_size (pool->used_map))
+		return BITMAP_ERROR;
+	return buddy;
+}
+
+/* Frees the block of ORDER at PAGE_IDX, merging it with its buddy
+   for as long as the buddy is a free block of the same order. */
+static void
+block_free (struct pool *pool, size_t page_idx, int order) {
+	while (order < MAX_ORDER) {
+		size_t buddy = buddy_of (pool, page_idx, order);
+
+		if (buddy == BITMAP_ERROR || pool->pages[buddy].order != order)
+			break;
+		block_remove (pool, buddy);
+		if (buddy < page_idx)
+			page_idx = buddy;
+		order++;
+	}
+	block_push (pool, page_idx, order);
+}
+
+/* Frees the PAGE_CNT pages at PAGE_IDX as the largest blocks that
+   alignment allows. */
+static void
+range_free (struct pool *pool, size_t page_idx, size_t page_cnt) {
+	while (page_cnt > 0) {
+		int order = 0;
+
+		while (order < MAX_ORDER
+				&& (page_idx + pool->shift) % block_pages (order + 1) == 0
+				&& block_pages (order + 1) <= page_cnt)
+			order++;
+		block_free (pool, page_idx, order);
+		page_idx += block_pages (order);
+		page_cnt -= block_pages (order);
+	}
+}
+
+/* Takes a block of ORDER off POOL's free lists, splitting the
+   smallest larger block if there is none.  Returns its index, or
+   BITMAP_ERROR. */
+static size_t
+block_alloc (struct pool *pool, int order) {
+	size_t page_idx;
+	int o;
+
+	for (o = order; o <= MAX_ORDER; o++)
+		if (!list_empty (&pool->free_list[o]))
+			break;
+	if (o > MAX_ORDER)
+		return BITMAP_ERROR;
+
+	page_idx = list_entry (list_front (&pool->free_list[o]),
+			struct buddy_page, elem) - pool->pages;
+	block_remove (pool, page_idx);
+	while (o > order) {
+		o--;
+		block_push (pool, page_idx + block_pages (o), o);
+	}
+	return page_idx;
+}
+
+/* Takes the free PAGE_CNT pages at PAGE_IDX off POOL's free lists,
+   giving back the parts of their blocks outside of the range. */
+static void
+range_take (struct pool *pool, size_t page_idx, size_t page_cnt) {
+	size_t end = page_idx + page_cnt, i = page_idx;
+
+	while (i < end) {
+		size_t head = 0, head_end;
+		int order;
+
+		/* Find the free block holding page I. */
+		for (order = 0; order <= MAX_ORDER; order++) {
+			size_t a = (i + pool->shift) & ~(block_pages (order) - 1);
+
+			if (a >= pool->shift && pool->pages[a - pool->shift].order == order) {
+				head = a - pool->shift;
+				break;
+			}
+		}
+		ASSERT (order <= MAX_ORDER);
+
+		block_remove (pool, head);
+		head_end = head + block_pages (order);
+		if (head < i)
+			range_free (pool, head, i - head);
+		if (head_end > end)
+			range_free (pool, end, head_end - end);
+		i = head_end;
+	}
+}
+
+/* Gives the pages of POOL's zero cache back to the free lists. */
+static void
+zero_drain (struct pool *pool) {
+	while (pool->zero_cnt > 0) {
+		size_t page_idx = pool->zeroed[--pool->zero_cnt];
+
+		bitmap_reset (pool->used_map, page_idx);
+		range_free (pool, page_idx, 1);
+		pool->free_cnt++;
+	}
+}
+
+/* Returns the index of the first of PAGE_CNT free pages of POOL
+   whose physical page number is a multiple of ALIGN, scanning
+   used_map, or BITMAP_ERROR.  For requests the free lists cannot
+   serve. */
+static size_t
+range_scan (struct pool *pool, size_t page_cnt, size_t align) {
+	size_t pool_cnt = bitmap_size (pool->used_map), page_idx;
+
+	if (align == 1)
+		return bitmap_scan (pool->used_map, 0, page_cnt, false);
+
+	/* First index whose physical page number is aligned. */
+	page_idx = (align - pg_no (vtop (pool->base)) % align) % align;
+	for (; page_idx + page_cnt <= pool_cnt; page_idx += align)
+		if (!bitmap_contains (pool->used_map, page_idx, page_cnt, true))
+			return page_idx;
+	return BITMAP_ERROR;
+}
+
+/* Allocates PAGE_CNT pages of POOL, the first at a multiple of ALIGN
+   physical pages, and returns the index of the first, or
+   BITMAP_ERROR.  Single zeroed pages come from the zero cache if
+   ZERO; *ZEROED tells whether the pages are known to be zero.
+   Interrupts must be off. */
+static size_t
+pool_alloc (struct pool *pool, size_t page_cnt, size_t align, bool zero,
+		bool *zeroed) {
+	int order = order_for (page_cnt > align ? page_cnt : align);
+	size_t page_idx;
+
+	ASSERT (intr_get_level () == INTR_OFF);
+
+	*zeroed = false;
+	if (zero && page_cnt == 1 && align == 1 && pool->zero_cnt > 0) {
+		*zeroed = true;
+		return pool->zeroed[--pool->zero_cnt];
+	}
+
+	if (order <= MAX_ORDER) {
+		page_idx = block_alloc (pool, order);
+		if (page_idx == BITMAP_ERROR && pool->zero_cnt > 0) {
+			zero_drain (pool);
+			page_idx = block_alloc (pool, order);
+		}
+		if (page_idx == BITMAP_ERROR)
+			return BITMAP_ERROR;
+		/* Give back what the request does not use. */
+		range_free (pool, page_idx + page_cnt, block_pages (order) - page_cnt);
+	} else {
+		zero_drain (pool);
+		page_idx = range_scan (pool, page_cnt, align);
+		if (page_idx == BITMAP_ERROR)
+			return BITMAP_ERROR;
+		range_take (pool, page_idx, page_cnt);
+	}
+
+	ASSERT (!bitmap_contains (pool->used_map, page_idx, page_cnt, true));
+	bitmap_set_multiple (pool->used_map, page_idx, page_cnt, true);
+	pool->free_cnt -= page_cnt;
+	return page_idx;
+}
+
 /* Obtains and returns a group of PAGE_CNT contiguous free pages.
    If PAL_USER is set, the pages are obtained from the user pool,
    otherwise from the kernel pool.  If PAL_ZERO is set in FLAGS,
@@ -261,26 +512,40 @@ palloc_init (void) {
    FLAGS, in which case the kernel panics. */
 void *
 palloc_get_multiple (enum palloc_flags flags, size_t page_cnt) {
+	return palloc_get_multiple_aligned (flags, page_cnt, 1);
+}
+
+/* Like palloc_get_multiple, but the physical address of the first
+   page is a multiple of ALIGN pages, which must be a power of two.
+   Used for memory that is mapped with large pages. */
+void *
+palloc_get_multiple_aligned (enum palloc_flags flags, size_t page_cnt,
+		size_t align) {
 	struct pool *pool = flags & PAL_USER ? &user_pool : &kernel_pool;
+	enum intr_level old_level;
+	size_t page_idx;
+	bool zeroed;
+	void *pages = NULL;
 
-	lock_acquire (&pool->lock);
-	size_t page_idx = bitmap_scan_and_flip (pool->used_map, 0, page_cnt, false);
-	lock_release (&pool->lock);
-	void *pages;
+	ASSERT (align > 0 && (align & (align - 1)) == 0);
 
-	if (page_idx != BITMAP_ERROR)
-		pages = pool->base + PGSIZE * page_idx;
-	else
-		pages = NULL;
+	old_level = intr_disable ();
+	page_idx = pool_alloc (pool, page_cnt, align, flags & PAL_ZERO, &zeroed);
+	intr_set_level (old_level);
 
-	if (pages) {
-		if (flags & PAL_ZERO)
-			memset (pages, 0, PGSIZE * page_cnt);
+	if (page_idx != BITMAP_ERROR) {
+		pages = pool->base + PGSIZE * page_idx;
+		if (flags & PAL_ZERO) {
+			zero_requests += page_cnt;
+			if (zeroed)
+				zero_hits += page_cnt;
+			else
+				memset (pages, 0, PGSIZE * page_cnt);
+		}
 	} else {
 		if (flags & PAL_ASSERT)
 			PANIC ("palloc_get: out of pages");
 	}
-
 	return pages;
 }
 
@@ -300,6 +565,7 @@ palloc_get_page (enum palloc_flags flags) {
 void
 palloc_free_multiple (void *pages, size_t page_cnt) {
 	struct pool *pool;
+	enum intr_level old_level;
 	size_t page_idx;
 
 	ASSERT (pg_ofs (pages) == 0);
@@ -318,8 +584,12 @@ palloc_free_multiple (void *pages, size_t page_cnt) {
 #ifndef NDEBUG
 	memset (pages, 0xcc, PGSIZE * page_cnt);
 #endif
+	old_level = intr_disable ();
 	ASSERT (bitmap_all (pool->used_map, page_idx, page_cnt));
 	bitmap_set_multiple (pool->used_map, page_idx, page_cnt, false);
+	range_free (pool, page_idx, page_cnt);
+	pool->free_cnt += page_cnt;
+	intr_set_level (old_level);
 }
 
 /* Frees the page at PAGE. */
@@ -328,23 +598,131 @@ palloc_free_page (void *page) {
 	palloc_free_multiple (page, 1);
 }
 
+/* Returns the number of free pages in the user pool if PAL_USER
+   is set in FLAGS, otherwise in the kernel pool. */
+size_t
+palloc_free_cnt (enum palloc_flags flags) {
+	struct pool *pool = flags & PAL_USER ? &user_pool : &kernel_pool;
+	enum intr_level old_level;
+	size_t cnt;
+
+	old_level = intr_disable ();
+	cnt = pool->free_cnt + pool->zero_cnt;
+	intr_set_level (old_level);
+	return cnt;
+}
+
+/* Zeroes one free page of POOL for the zero cache.  Returns false
+   if the cache is full or the pool has no free page. */
+static bool
+zero_one (struct pool *pool) {
+	enum intr_level old_level;
+	size_t page_idx = BITMAP_ERROR;
+
+	old_level = intr_disable ();
+	if (pool->zero_cnt < ZERO_CACHE_PAGES) {
+		page_idx = block_alloc (pool, 0);
+		if (page_idx != BITMAP_ERROR) {
+			bitmap_mark (pool->used_map, page_idx);
+			pool->free_cnt--;
+		}
+	}
+	intr_set_level (old_level);
+	if (page_idx == BITMAP_ERROR)
+		return false;
+
+	memset (pool->base + PGSIZE * page_idx, 0, PGSIZE);
+	idle_zeroed++;
+
+	/* Only the idle thread fills the cache, so there is still room. */
+	old_level = intr_disable ();
+	pool->zeroed[pool->zero_cnt++] = page_idx;
+	intr_set_level (old_level);
+	return true;
+}
+
+/* Called by the idle thread with interrupts on.  Zeroes a free page
+   for a later PAL_ZERO request and returns true, or returns false
+   if there is nothing to do. */
+bool
+palloc_zero_idle (void) {
+	return zero_one (&user_pool) || zero_one (&kernel_pool);
+}
+
+/* Prints the free blocks of each order of POOL, which shows how
+   fragmented it is. */
+static void
+print_pool_stats (const char *name, struct pool *pool) {
+	int order;
+
+	printf ("Palloc: %s pool %zu free pages, free blocks by order:",
+			name, pool->free_cnt + pool->zero_cnt);
+	for (order = 0; order <= MAX_ORDER; order++)
+		printf (" %zu", list_size (&pool->free_list[order]));
+	printf ("\n");
+}
+
+/* Prints page allocator statistics. */
+void
+palloc_print_stats (void) {
+	printf ("Palloc: %lld zeroed pages requested, %lld already zero, "
+			"%lld zeroed while idle\n",
+			zero_requests, zero_hits, idle_zeroed);
+	print_pool_stats ("kernel", &kernel_pool);
+	print_pool_stats ("user", &user_pool);
+}
+
+/* Stores the kernel virtual address of the first page of the user
+   pool in *BASE and its number of pages in *PAGE_CNT. */
+void
+palloc_user_range (void **base, size_t *page_cnt) {
+	*base = user_pool.base;
+	*page_cnt = bitmap_size (user_pool.used_map);
+}
+
 /* Initializes pool P as starting at START and ending at END */
 static void
 init_pool (struct pool *p, void **bm_base, uint64_t start, uint64_t end) {
-  /* We'll put the pool's used_map at its base.
-     Calculate the space needed for the bitmap
-     and subtract it from the pool's size. */
+  /* We'll put the pool's used_map and buddy state at its base.
+     Calculate the space needed for them and subtract it from the
+     pool's size. */
 	uint64_t pgcnt = (end - start) / PGSIZE;
 	size_t bm_pages = DIV_ROUND_UP (bitmap_buf_size (pgcnt), PGSIZE) * PGSIZE;
+	size_t buddy_pages = ROUND_UP (pgcnt * sizeof *p->pages, PGSIZE);
+	size_t i;
+	int order;
 
-	lock_init(&p->lock);
 	p->used_map = bitmap_create_in_buf (pgcnt, *bm_base, bm_pages);
 	p->base = (void *) start;
+	p->pages = *bm_base + bm_pages;
+	for (i = 0; i < pgcnt; i++)
+		p->pages[i].order = NO_ORDER;
+	for (order = 0; order <= MAX_ORDER; order++)
+		list_init (&p->free_list[order]);
+	p->shift = pg_no (vtop (p->base)) % block_pages (MAX_ORDER);
+	p->free_cnt = 0;
+	p->zero_cnt = 0;
 
 	// Mark all to unusable.
 	bitmap_set_all(p->used_map, true);
 
-	*bm_base += bm_pages;
+	*bm_base += bm_pages + buddy_pages;
+}
+
+/* Puts the pages of P that populate_pools found usable on its free
+   lists. */
+static void
+init_free_lists (struct pool *p) {
+	size_t pgcnt = bitmap_size (p->used_map), start = 0, end;
+
+	while ((start = bitmap_scan (p->used_map, start, 1, false)) != BITMAP_ERROR) {
+		end = bitmap_scan (p->used_map, start, 1, true);
+		if (end == BITMAP_ERROR)
+			end = pgcnt;
+		range_free (p, start, end - start);
+		p->free_cnt += end - start;
+		start = end;
+	}
 }
 
 /* Returns true if PAGE was allocated from POOL,
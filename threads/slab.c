@@ -0,0 +1,244 @@
+#include "threads/slab.h"
+#include <debug.h>
+#include <list.h>
+#include <round.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+
+/* An object cache allocator, after Bonwick's slab allocator.
+
+   Each cache hands out objects of a single size.  It gets pages
+   ("slabs") from the page allocator and cuts each of them into as
+   many objects as fit after a small header, so objects are not
+   rounded up to a power of two as with malloc().  If the cache has
+   a constructor, it runs once for each object when its slab is
+   created, and a freed object must be left in its constructed
+   state, ready to be handed out again.
+
+   The space a slab has left over is used to start the objects of
+   successive slabs at different offsets ("colors"), one cache line
+   apart, so that the same object of different slabs does not
+   always land on the same cache lines.
+
+   A cache keeps one completely free slab around, so that a cache
+   whose use goes up and down by a few objects does not keep
+   getting and freeing a page. */
+
+/* Size of a cache line, the unit of slab coloring. */
+#define CACHE_LINE 64
+
+/* Objects are aligned to this many bytes. */
+#define OBJ_ALIGN 8
+
+/* Magic number for detecting slab corruption. */
+#define SLAB_MAGIC 0x51ab51ab
+
+/* An object cache. */
+struct kmem_cache {
+	const char *name;           /* For statistics. */
+	size_t size;                /* Object size, aligned. */
+	size_t obj_cnt;             /* Objects per slab. */
+	size_t hdr_size;            /* Bytes before the uncolored objects. */
+	size_t color_cnt;           /* Number of colors. */
+	size_t color;               /* Color of the next slab. */
+	void (*ctor) (void *);      /* Constructor, or null. */
+	struct lock lock;           /* Protects the members below. */
+	struct list partial;        /* Slabs with free and used objects. */
+	struct list full;           /* Slabs with no free object. */
+	struct list empty;          /* Slabs with no used object. */
+
+	/* Statistics. */
+	size_t slab_cnt;            /* Slabs owned. */
+	size_t in_use;              /* Objects handed out. */
+	long long allocs;           /* kmem_cache_alloc() calls. */
+	long long frees;            /* kmem_cache_free() calls. */
+
+	struct list_elem elem;      /* In all_caches. */
+};
+
+/* A slab, at the start of its page. */
+struct slab {
+	unsigned magic;             /* Always set to SLAB_MAGIC. */
+	struct kmem_cache *cache;   /* Owning cache. */
+	struct list_elem elem;      /* In one of the cache's lists. */
+	uint8_t *objs;              /* First object. */
+	size_t free_cnt;            /* Free objects. */
+	uint16_t free[];            /* Indexes of the free objects. */
+};
+
+/* All caches, for statistics.  Caches are created while booting,
+   by one thread at a time. */
+static struct list all_caches;
+
+/* Initializes the object cache allocator. */
+void
+kmem_init (void) {
+	list_init (&all_caches);
+}
+
+/* Returns the number of bytes in front of the objects of a slab of
+   OBJ_CNT objects, before coloring. */
+static size_t
+header_size (size_t obj_cnt) {
+	return ROUND_UP (sizeof (struct slab) + obj_cnt * sizeof (uint16_t),
+			OBJ_ALIGN);
+}
+
+/* Creates and returns a cache of objects of SIZE bytes, named NAME
+   in the statistics.  If CTOR is non-null it is called on each new
+   object.  Panics if the kernel is out of memory, since caches are
+   created while booting. */
+struct kmem_cache *
+kmem_cache_create (const char *name, size_t size, void (*ctor) (void *)) {
+	struct kmem_cache *c;
+	size_t obj_cnt;
+
+	size = ROUND_UP (size, OBJ_ALIGN);
+	obj_cnt = (PGSIZE - sizeof (struct slab)) / (size + sizeof (uint16_t));
+	while (obj_cnt > 0 && header_size (obj_cnt) + obj_cnt * size > PGSIZE)
+		obj_cnt--;
+	ASSERT (obj_cnt > 0);
+
+	c = malloc (sizeof *c);
+	if (c == NULL)
+		PANIC ("kmem_cache_create: out of memory");
+	c->name = name;
+	c->size = size;
+	c->obj_cnt = obj_cnt;
+	c->hdr_size = header_size (obj_cnt);
+	c->color_cnt = (PGSIZE - c->hdr_size - obj_cnt * size) / CACHE_LINE + 1;
+	c->color = 0;
+	c->ctor = ctor;
+	lock_init (&c->lock);
+	list_init (&c->partial);
+	list_init (&c->full);
+	list_init (&c->empty);
+	c->slab_cnt = 0;
+	c->in_use = 0;
+	c->allocs = 0;
+	c->frees = 0;
+	list_push_back (&all_caches, &c->elem);
+	return c;
+}
+
+/* Returns a new slab for cache C, or a null pointer if no page is
+   available.  Must hold C's lock. */
+static struct slab *
+slab_create (struct kmem_cache *c) {
+	struct slab *s = palloc_get_page (0);
+	size_t i;
+
+	if (s == NULL)
+		return NULL;
+	s->magic = SLAB_MAGIC;
+	s->cache = c;
+	s->objs = (uint8_t *) s + c->hdr_size + c->color * CACHE_LINE;
+	c->color = (c->color + 1) % c->color_cnt;
+
+	/* Hand out the objects in address order. */
+	s->free_cnt = c->obj_cnt;
+	for (i = 0; i < c->obj_cnt; i++) {
+		s->free[i] = c->obj_cnt - 1 - i;
+		if (c->ctor != NULL)
+			c->ctor (s->objs + i * c->size);
+	}
+	c->slab_cnt++;
+	return s;
+}
+
+/* Obtains and returns an object from cache C.  Returns a null
+   pointer if memory is not available.  The object is not
+   initialized, except by C's constructor. */
+void *
+kmem_cache_alloc (struct kmem_cache *c) {
+	struct slab *s;
+	void *obj;
+
+	lock_acquire (&c->lock);
+	if (list_empty (&c->partial)) {
+		if (!list_empty (&c->empty))
+			s = list_entry (list_pop_front (&c->empty), struct slab, elem);
+		else if ((s = slab_create (c)) == NULL) {
+			lock_release (&c->lock);
+			return NULL;
+		}
+		list_push_front (&c->partial, &s->elem);
+	}
+
+	s = list_entry (list_front (&c->partial), struct slab, elem);
+	obj = s->objs + s->free[--s->free_cnt] * c->size;
+	if (s->free_cnt == 0) {
+		list_remove (&s->elem);
+		list_push_front (&c->full, &s->elem);
+	}
+	c->in_use++;
+	c->allocs++;
+	lock_release (&c->lock);
+	return obj;
+}
+
+/* Returns OBJ, which must have been obtained from cache C, to C. */
+void
+kmem_cache_free (struct kmem_cache *c, void *obj) {
+	struct slab *s;
+	size_t ofs;
+
+	if (obj == NULL)
+		return;
+
+	s = pg_round_down (obj);
+	ASSERT (s->magic == SLAB_MAGIC);
+	ASSERT (s->cache == c);
+	ofs = (uint8_t *) obj - s->objs;
+	ASSERT (ofs % c->size == 0 && ofs / c->size < c->obj_cnt);
+
+#ifndef NDEBUG
+	/* Clear the object to help detect use-after-free bugs, unless
+	   it has to stay constructed. */
+	if (c->ctor == NULL)
+		memset (obj, 0xcc, c->size);
+#endif
+
+	lock_acquire (&c->lock);
+	ASSERT (s->free_cnt < c->obj_cnt);
+	if (s->free_cnt == 0) {
+		list_remove (&s->elem);
+		list_push_front (&c->partial, &s->elem);
+	}
+	s->free[s->free_cnt++] = ofs / c->size;
+
+	/* Keep one free slab, give the others back. */
+	if (s->free_cnt == c->obj_cnt) {
+		list_remove (&s->elem);
+		if (list_empty (&c->empty))
+			list_push_front (&c->empty, &s->elem);
+		else {
+			palloc_free_page (s);
+			c->slab_cnt--;
+		}
+	}
+	c->in_use--;
+	c->frees++;
+	lock_release (&c->lock);
+}
+
+/* Prints statistics of each cache. */
+void
+kmem_print_stats (void) {
+	struct list_elem *e;
+
+	for (e = list_begin (&all_caches); e != list_end (&all_caches);
+			e = list_next (e)) {
+		struct kmem_cache *c = list_entry (e, struct kmem_cache, elem);
+
+		printf ("Slab: %s: %zu of %zu-byte objects in use, %zu per slab, "
+				"%zu slabs, %lld allocs, %lld frees\n",
+				c->name, c->in_use, c->size, c->obj_cnt, c->slab_cnt,
+				c->allocs, c->frees);
+	}
+}
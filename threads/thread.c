@@ -572,6 +572,16 @@ idle (void *idle_started_ UNUSED) {
 		intr_disable ();
 		thread_block ();
 
+		/* Nothing else wants the CPU, so zero free pages ahead of
+		   PAL_ZERO requests.  A thread woken meanwhile preempts us;
+		   check for one before halting. */
+		intr_enable ();
+		while (palloc_zero_idle ())
+			continue;
+		intr_disable ();
+		if (!list_empty (&ready_list))
+			continue;
+
 		/* Re-enable interrupts and wait for the next one.
 
 		   The `sti' instruction disables interrupts until the
@@ -149,7 +149,11 @@ page_fault (struct intr_frame *f) {
 	/* Count page faults. */
 	page_fault_cnt++;
 
-	if (not_present || user || fault_addr >= LOADER_PHYS_BASE)
+	/* The kernel honours read-only user pages (CR0.WP), so a rights
+	   violation on a user address in kernel context means a system
+	   call was handed a buffer it may not write. */
+	if (not_present || user || fault_addr >= LOADER_PHYS_BASE
+			|| is_user_vaddr (fault_addr))
 		exit(-1);
 
 	/* If the fault is true fault, show info and exit. */
@@ -15,6 +15,7 @@
 #include "threads/init.h"
 #include "threads/interrupt.h"
 #include "threads/palloc.h"
+#include "threads/slab.h"
 #include "threads/thread.h"
 #include "threads/mmu.h"
 #include "threads/vaddr.h"
@@ -26,6 +27,7 @@
 static void process_cleanup (void);
 static bool load (const char *file_name, struct intr_frame *if_);
 static void initd (void *f_name);
+static void __do_spawn (void *aux);
 
 extern struct lock filesys_lock;
 
@@ -79,8 +81,8 @@ process_create_initd (const char *file_name) {
 static void
 initd (void *f_name) {
 	struct thread* current = thread_current();
-	struct file_elem* f_el_stdin = malloc(sizeof(struct file_elem));
-	struct file_elem* f_el_stdout = malloc(sizeof(struct file_elem));
+	struct file_elem* f_el_stdin = kmem_cache_alloc(file_elem_slab);
+	struct file_elem* f_el_stdout = kmem_cache_alloc(file_elem_slab);
 #ifdef VM
 	supplemental_page_table_init (&thread_current ()->spt);
 #endif
@@ -143,7 +145,7 @@ copy_file_list(struct thread* parent, struct thread* child) {
 			free(map);
 			return false;
 		}
-		new_f_el = malloc(sizeof(struct file_elem));
+		new_f_el = kmem_cache_alloc(file_elem_slab);
 		if (new_f_el == NULL) {
 			free(map);
 			return false;
@@ -163,7 +165,7 @@ copy_file_list(struct thread* parent, struct thread* child) {
 			} else if (f_el->fd > 1 && f_el->reference != 0 && f_el->reference != 1) {
 				new_f_el->file = file_duplicate(f_el->file);
 				if (new_f_el->file == NULL) {
-					free(new_f_el);
+					kmem_cache_free(file_elem_slab, new_f_el);
 					free(map);
 					return false;
 				}
@@ -318,6 +320,88 @@ error:
 	thread_exit ();
 }
 
+/* Passed from process_spawn() to the new process. */
+struct spawn_info {
+	struct thread *parent;
+	char *cmd_line;				/* Page of the command line. */
+	struct semaphore started;	/* Up once the child is registered. */
+	bool success;
+};
+
+/* Starts a child of the current process that runs CMD_LINE, like fork
+ * followed by exec in the child, but without copying the address
+ * space that exec would throw away: the child inherits only the open
+ * files and the working directory.  Returns the child's thread id, or
+ * TID_ERROR if it cannot be created.  A program that fails to load
+ * makes the child exit with -1.  There are no file actions as with
+ * posix_spawn(): the child gets the descriptors the parent has at the
+ * call, so a parent that wants to hand it others sets them up with
+ * dup2() and close() around the call. */
+tid_t
+process_spawn (const char *cmd_line) {
+	struct spawn_info info;
+	char name[16], *save_ptr;
+	tid_t tid;
+
+	info.cmd_line = palloc_get_page (0);
+	if (info.cmd_line == NULL)
+		return TID_ERROR;
+	strlcpy (info.cmd_line, cmd_line, PGSIZE);
+	strlcpy (name, cmd_line, sizeof name);
+	strtok_r (name, " ", &save_ptr);
+	info.parent = thread_current ();
+	info.success = false;
+	sema_init (&info.started, 0);
+
+	tid = thread_create (name, PRI_DEFAULT, __do_spawn, &info);
+	if (tid == TID_ERROR) {
+		palloc_free_page (info.cmd_line);
+		return TID_ERROR;
+	}
+	sema_down (&info.started);
+	return info.success ? tid : TID_ERROR;
+}
+
+/* A thread function that sets up a process started by
+ * process_spawn() and runs its program. */
+static void
+__do_spawn (void *aux) {
+	struct spawn_info *info = aux;
+	struct thread *current = thread_current ();
+	struct thread *parent = info->parent;
+	char *cmd_line = info->cmd_line;
+	struct child_elem *c_el;
+
+#ifdef VM
+	supplemental_page_table_init (&current->spt);
+#endif
+	process_init ();
+	c_el = palloc_get_page (PAL_ZERO);
+	lock_acquire (&filesys_lock);
+	if (c_el == NULL || !copy_file_list (parent, current)) {
+		lock_release (&filesys_lock);
+		if (c_el != NULL)
+			palloc_free_page (c_el);
+		palloc_free_page (cmd_line);
+		sema_up (&info->started);
+		exit (-1);
+	}
+	current->current_dir = dir_reopen (parent->current_dir);
+	lock_release (&filesys_lock);
+	current->parent = parent;
+	c_el->tid = current->tid;
+	c_el->terminated = false;
+	c_el->waiting = false;
+	c_el->waiting_sema = NULL;
+	list_push_front (&parent->children_list, &c_el->elem);
+	info->success = true;
+	sema_up (&info->started);
+
+	if (process_exec (cmd_line) < 0)
+		exit (-1);
+	NOT_REACHED ();
+}
+
 /* Switch the current execution context to the f_name.
  * Returns -1 on fail. */
 int
@@ -469,8 +553,11 @@ process_cleanup (void) {
  * This function is called on every context switch. */
 void
 process_activate (struct thread *next) {
-	/* Activate thread's page tables. */
-	pml4_activate (next->pml4);
+	/* Activate thread's page tables.  Kernel threads have none and
+	 * keep running on the loaded ones, whose kernel half is the same
+	 * in every page map. */
+	if (next->pml4 != NULL)
+		pml4_activate (next->pml4);
 
 	/* Set thread's kernel stack for use in processing interrupts. */
 	tss_update (next);
@@ -860,32 +947,45 @@ lazy_load_segment (struct page *page, void *aux) {
 	/* TODO: This called when the first page fault occurs on address VA. */
 	/* TODO: VA is available when calling this function. */
 	struct lazy_parameter * params = (struct lazy_parameter *)aux;
-	bool acquired = false;
 	
 	if (params->file == NULL)
 		return false;
 
 	if (params->read_bytes > 0) {
-		if (!lock_held_by_current_thread(&filesys_lock)) {
-			lock_acquire(&filesys_lock);
-			acquired = true;
-		}
-		file_read_at(params->file, params->upage, params->read_bytes, params->ofs);
-		if (acquired)
-			lock_release(&filesys_lock);
+		lock_acquire(&filesys_lock);
+		file_read_at(params->file, page->frame->kva, params->read_bytes, params->ofs);
+		lock_release(&filesys_lock);
 	}
 	if (params->zero_bytes > 0)
-		memset(page->va + params->read_bytes, 0, params->zero_bytes);
+		memset(page->frame->kva + params->read_bytes, 0, params->zero_bytes);
 	file_close(params->file);
-	free(aux);
+	kmem_cache_free(lazy_parameter_slab, aux);
+	return true;
+}
+
+/* Initializer of a read-only page of the executable.  Nothing is read
+ * here: the page only remembers where its contents are, so that
+ * processes running the same file can share one frame for it. */
+static bool
+lazy_load_text (struct page *page, void *aux) {
+	struct lazy_parameter *params = (struct lazy_parameter *)aux;
+
+	page->anon.text_file = params->file;
+	page->anon.text_ofs = params->ofs;
+	page->anon.text_read_bytes = params->read_bytes;
+	kmem_cache_free(lazy_parameter_slab, aux);
 	return true;
 }
 
 void *
 copy_lazy_parameter(struct page* src, void* dst) {
-	struct lazy_parameter *aux = malloc(sizeof(struct lazy_parameter));
 	struct lazy_parameter *src_aux = (struct lazy_parameter *)src->uninit.aux;
+	struct lazy_parameter *aux;
 
+	/* Zero-fill pages have nothing to copy. */
+	if (src_aux == NULL)
+		return NULL;
+	aux = kmem_cache_alloc(lazy_parameter_slab);
 	aux->file = file_reopen(src_aux->file);
 	aux->ofs = src_aux->ofs;
 	aux->read_bytes = src_aux->read_bytes;
@@ -914,32 +1014,21 @@ load_segment (struct file *file, off_t ofs, uint8_t *upage,
 	ASSERT ((read_bytes + zero_bytes) % PGSIZE == 0);
 	ASSERT (pg_ofs (upage) == 0);
 	ASSERT (ofs % PGSIZE == 0);
-	unsigned cnt = 0;
+	struct region_tree *regions = &thread_current ()->spt.regions;
+	struct file *segment_file = NULL;
 
-	while (read_bytes > 0 || zero_bytes > 0) {
-		/* Do calculate how to fill this page.
-		 * We will read PAGE_READ_BYTES bytes from FILE
-		 * and zero the final PAGE_ZERO_BYTES bytes. */
-		size_t page_read_bytes = read_bytes < PGSIZE ? read_bytes : PGSIZE;
-		size_t page_zero_bytes = page_read_bytes < PGSIZE ? PGSIZE - page_read_bytes : 0;
-
-		/* TODO: Set up aux to pass information to the lazy_load_segment. */
-		struct lazy_parameter *aux = malloc(sizeof(struct lazy_parameter));
-		aux->file = file_reopen(file);
-		aux->ofs = ofs + cnt * PGSIZE;
-		aux->read_bytes = page_read_bytes;
-		aux->zero_bytes = page_zero_bytes;
-		aux->upage = upage;
-		aux->copy = copy_lazy_parameter;
-		if (!vm_alloc_page_with_initializer (VM_ANON, upage,
-					writable, lazy_load_segment, aux))
-			return false;
-
-		/* Advance. */
-		read_bytes -= page_read_bytes;
-		zero_bytes -= page_zero_bytes;
-		upage += PGSIZE;
-		cnt++;
+	/* Only the region is recorded; each page is created by the first
+	 * fault on it, and starts out as the zero page if it has nothing
+	 * to read. */
+	if (read_bytes > 0 && (segment_file = file_reopen (file)) == NULL)
+		return false;
+	if (!region_add (regions, upage, upage + read_bytes + zero_bytes,
+				segment_file, ofs, read_bytes,
+				writable ? VM_ANON : VM_ANON | VM_TEXT, writable,
+				writable ? lazy_load_segment : lazy_load_text)) {
+		if (segment_file != NULL)
+			file_close (segment_file);
+		return false;
 	}
 	return true;
 }
@@ -954,7 +1043,7 @@ setup_stack (struct intr_frame *if_) {
 	 * TODO: If success, set the rsp accordingly.
 	 * TODO: You should mark the page is stack. */
 	/* TODO: Your code goes here */
-	success = vm_alloc_page_with_initializer(VM_ANON, stack_bottom, true, after_stack_set, NULL);
+	success = vm_alloc_page_with_initializer(VM_ANON | VM_ZERO_FILL, stack_bottom, true, after_stack_set, NULL);
 
 	if (success)
 		if_->rsp = USER_STACK;
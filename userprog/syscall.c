@@ -6,6 +6,7 @@
 #include <syscall-nr.h>
 #include "threads/interrupt.h"
 #include "threads/palloc.h"
+#include "threads/slab.h"
 #include "threads/thread.h"
 #include "threads/loader.h"
 #include "filesys/filesys.h"
@@ -25,6 +26,10 @@ void syscall_handler (struct intr_frame *);
 bool compare_file_elem (const struct list_elem *e1, const struct list_elem *e2);
 
 struct lock filesys_lock;
+struct kmem_cache *file_elem_slab;
+
+/* Largest part of a user buffer pinned at once by read and write. */
+#define PIN_CHUNK (16 * PGSIZE)
 
 /* System call.
  *
@@ -42,6 +47,7 @@ struct lock filesys_lock;
 void
 syscall_init (void) {
 	lock_init(&filesys_lock);
+	file_elem_slab = kmem_cache_create("file_elem", sizeof(struct file_elem), NULL);
 	write_msr(MSR_STAR, ((uint64_t)SEL_UCSEG - 0x10) << 48  |
 			((uint64_t)SEL_KCSEG) << 32);
 	write_msr(MSR_LSTAR, (uint64_t) syscall_entry);
@@ -72,6 +78,49 @@ file_elem_by_fd(int fd) {
 	return NULL;
 }
 
+/* Pins the user buffer [BUFFER, BUFFER + SIZE), so that the kernel
+ * does not fault on it while it holds filesys_lock.  Kills the
+ * process if the buffer is not mapped, or not writable for WRITE. */
+static void
+pin_user_buffer (const void *buffer UNUSED, size_t size UNUSED,
+		bool write UNUSED) {
+#ifdef VM
+	if (!vm_pin_range(buffer, size, write))
+		exit(-1);
+#endif
+}
+
+static void
+unpin_user_buffer (const void *buffer UNUSED, size_t size UNUSED) {
+#ifdef VM
+	vm_unpin_range(buffer, size);
+#endif
+}
+
+/* Pins the user string STR up to its null terminator and returns its
+ * length plus one, the size to pass to unpin_user_buffer.  Kills the
+ * process if the string runs into an unmapped page. */
+static size_t
+pin_user_string (const char *str) {
+	size_t len = 0, chunk;
+
+	if (str == NULL || is_kernel_vaddr(str))
+		exit(-1);
+	for (;;) {
+		chunk = PGSIZE - pg_ofs(str + len);
+#ifdef VM
+		if (!vm_pin_range(str + len, chunk, false)) {
+			unpin_user_buffer(str, len);
+			exit(-1);
+		}
+#endif
+		/* The pinned pages are exactly those of the string so far. */
+		for (; chunk > 0; chunk--, len++)
+			if (str[len] == '\0')
+				return len + 1;
+	}
+}
+
 void
 halt(void) {
 	power_off();
@@ -115,7 +164,7 @@ close_all_files(void) {
 			}
 		}
 		list_remove(&f_el->elem);
-		free(f_el);
+		kmem_cache_free(file_elem_slab, f_el);
 	}
 	free(closed_files);
 }
@@ -152,6 +201,13 @@ fork (const char *thread_name) {
 	return running_thread()->status == THREAD_RUNNING ? (parent_lock > 0 ? child_pid : TID_ERROR) : 0;
 }
 
+pid_t
+spawn (const char *cmd_line) {
+	if (thread_current()->depth > 40)
+		return TID_ERROR;
+	return process_spawn(cmd_line);
+}
+
 int
 exec (const char *cmd_line) {
 	int result;
@@ -168,15 +224,18 @@ exec (const char *cmd_line) {
 bool
 create (const char *file, unsigned initial_size) {
 	bool ret;
+	size_t len;
 
 	if (file == NULL) {
 		exit(-1);
 	} else if (thread_current()->current_dir->inode->removed) {
 		return false;
 	}
+	len = pin_user_string(file);
 	lock_acquire(&filesys_lock);
 	ret = filesys_create(file, initial_size);
 	lock_release(&filesys_lock);
+	unpin_user_buffer(file, len);
 	return ret;
 }
 
@@ -191,19 +250,21 @@ bool
 remove (const char *file) {
 	// TODO: 열려 있는 파일의 remove 처리
 	bool ret;
+	size_t len = pin_user_string(file);
 
 	lock_acquire(&filesys_lock);
 	ret = filesys_remove(file);
 	lock_release(&filesys_lock);
+	unpin_user_buffer(file, len);
 	return ret;
 }
 
-int
-open (const char *file) {
+static int
+do_open (const char *file) {
 	struct thread* curr = thread_current();
 	struct file* opened_file = NULL;
 	struct dir* opened_dir = NULL;
-	struct file_elem* new_f_el = malloc(sizeof(struct file_elem));
+	struct file_elem* new_f_el = kmem_cache_alloc(file_elem_slab);
 	int new_fd = 2;
 	struct list_elem* el;
 	struct file_elem* f_el;
@@ -279,6 +340,15 @@ done:
 	return new_fd;
 }
 
+int
+open (const char *file) {
+	size_t len = pin_user_string(file);
+	int fd = do_open(file);
+
+	unpin_user_buffer(file, len);
+	return fd;
+}
+
 int
 filesize (int fd) {
 	int size;
@@ -310,14 +380,24 @@ read (int fd, void *buffer, unsigned size) {
 	} else if(fd == 1) {
 		exit(-1);
 	}	else {
-#ifdef VM
-		if (!spt_find_page (&thread_current()->spt, pg_round_down(buffer))->writable) {
-			exit(-1);
+		/* The buffer is pinned one chunk at a time, so that a large
+		 * read does not pin a large part of memory. */
+		read_size = 0;
+		while (size > 0) {
+			unsigned chunk = size < PIN_CHUNK ? size : PIN_CHUNK;
+			int done;
+
+			pin_user_buffer(buffer, chunk, true);
+			lock_acquire(&filesys_lock);
+			done = file_read(f_el->file, buffer, chunk);
+			lock_release(&filesys_lock);
+			unpin_user_buffer(buffer, chunk);
+			read_size += done;
+			if (done < (int) chunk)
+				break;
+			buffer += chunk;
+			size -= chunk;
 		}
-#endif
-		lock_acquire(&filesys_lock);
-		read_size = file_read(f_el->file, buffer, size);
-		lock_release(&filesys_lock);
 	}
 	return read_size;
 }
@@ -332,19 +412,38 @@ write (int fd, const void *buffer, unsigned size) {
 		exit(-1);
 
 	if (fd == 1 || f_el->reference == 1) {
-		if (f_el->open) {
+		written_size = 0;
+		while (f_el->open && size > 0) {
+			unsigned chunk = size < PIN_CHUNK ? size : PIN_CHUNK;
+
+			pin_user_buffer(buffer, chunk, false);
 			lock_acquire(&filesys_lock);
-			putbuf(buffer, size);
+			putbuf(buffer, chunk);
 			lock_release(&filesys_lock);
+			unpin_user_buffer(buffer, chunk);
+			written_size += chunk;
+			buffer += chunk;
+			size -= chunk;
 		}
-		else
-			written_size = 0;
 	} else if (fd == 0) {
 		exit(-1);
 	} else {
-		lock_acquire(&filesys_lock);
-		written_size = file_write(f_el->file, buffer, size);
-		lock_release(&filesys_lock);
+		written_size = 0;
+		while (size > 0) {
+			unsigned chunk = size < PIN_CHUNK ? size : PIN_CHUNK;
+			int done;
+
+			pin_user_buffer(buffer, chunk, false);
+			lock_acquire(&filesys_lock);
+			done = file_write(f_el->file, buffer, chunk);
+			lock_release(&filesys_lock);
+			unpin_user_buffer(buffer, chunk);
+			written_size += done;
+			if (done < (int) chunk)
+				break;
+			buffer += chunk;
+			size -= chunk;
+		}
 	}
 	return written_size;
 }
@@ -423,7 +522,7 @@ close (int fd) {
 			lock_release(&filesys_lock);
 		}
 		list_remove(&f_el->elem);
-		free(f_el);
+		kmem_cache_free(file_elem_slab, f_el);
 	}
 }
 
@@ -449,7 +548,7 @@ dup2(int oldfd, int newfd) {
 		}
 		new_f_el->file = old_f_el->file;
 	}	else {
-		new_f_el = malloc(sizeof(struct file_elem));
+		new_f_el = kmem_cache_alloc(file_elem_slab);
 		if (new_f_el == NULL)
 			return -1;
 		new_f_el->fd = newfd;
@@ -467,20 +566,105 @@ dup2(int oldfd, int newfd) {
 }
 
 void *
-mmap (void *addr, size_t length, int writable, int fd, off_t offset) {
+mmap (void *addr UNUSED, size_t length UNUSED, int writable UNUSED,
+		int fd UNUSED, off_t offset UNUSED) {
+#ifdef VM
 	struct file_elem* f_el = file_elem_by_fd(fd);
+	bool populate = (writable & MAP_POPULATE) != 0;
 
 	if (f_el == NULL || fd == 0 || fd == 1 || addr == NULL || is_kernel_vaddr(addr) || 
 			length == 0 || !file_length(f_el->file) || offset % PGSIZE != 0)
 		return NULL;
 	if (pg_round_down(addr) != addr)	// addr is not alligned
 		return NULL;
-	return do_mmap(addr, length, writable, f_el->file, offset);
+	addr = do_mmap(addr, length, writable & ~MAP_POPULATE, f_el->file, offset);
+	if (addr != NULL && populate)
+		vm_populate(addr, addr + length, false);
+	return addr;
+#else
+	return NULL;
+#endif
 }
 
 void
-munmap (void *addr) {
+munmap (void *addr UNUSED) {
+#ifdef VM
 	do_munmap(pg_round_down(addr));
+#endif
+}
+
+int
+madvise (void *addr UNUSED, size_t length UNUSED, int advice UNUSED) {
+#ifdef VM
+	void *end = pg_round_up(addr + length);
+
+	if (pg_ofs(addr) != 0 || end < addr || is_kernel_vaddr(end - 1))
+		return -1;
+	switch (advice) {
+	case MADV_NORMAL:
+		return vm_advise(addr, end, VM_ADV_NORMAL) ? 0 : -1;
+	case MADV_RANDOM:
+		return vm_advise(addr, end, VM_ADV_RANDOM) ? 0 : -1;
+	case MADV_SEQUENTIAL:
+		return vm_advise(addr, end, VM_ADV_SEQUENTIAL) ? 0 : -1;
+	case MADV_WILLNEED:
+		vm_populate(addr, end, true);
+		return 0;
+	case MADV_DONTNEED:
+		vm_drop_range(addr, end);
+		return 0;
+	default:
+		return -1;
+	}
+#else
+	return -1;
+#endif
+}
+
+int
+msync (void *addr UNUSED, size_t length UNUSED, int flags UNUSED) {
+#ifdef VM
+	void *end = pg_round_up(addr + length);
+
+	if (pg_ofs(addr) != 0 || end < addr || is_kernel_vaddr(end - 1)
+			|| ((flags & MS_ASYNC) && (flags & MS_SYNC)))
+		return -1;
+	/* Dirty pages are written within vm_writeback_secs anyway. */
+	if (!(flags & MS_ASYNC) || vm_writeback_secs == 0)
+		vm_msync(addr, end);
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+int
+mlock (const void *addr UNUSED, size_t length UNUSED) {
+#ifdef VM
+	void *start = pg_round_down(addr);
+	void *end = pg_round_up(addr + length);
+
+	if (end < start || is_kernel_vaddr(end - 1))
+		return -1;
+	return vm_mlock(start, end) ? 0 : -1;
+#else
+	return -1;
+#endif
+}
+
+int
+munlock (const void *addr UNUSED, size_t length UNUSED) {
+#ifdef VM
+	void *start = pg_round_down(addr);
+	void *end = pg_round_up(addr + length);
+
+	if (end < start || is_kernel_vaddr(end - 1))
+		return -1;
+	vm_munlock(start, end);
+	return 0;
+#else
+	return -1;
+#endif
 }
 
 void
@@ -573,10 +757,14 @@ inumber(int fd) {
 int
 symlink (const char *target, const char *linkpath) {
 	bool success = false;
+	size_t target_len = pin_user_string(target);
+	size_t linkpath_len = pin_user_string(linkpath);
 
 	lock_acquire(&filesys_lock);
 	success = filesys_create_symlink(target, linkpath);
 	lock_release(&filesys_lock);
+	unpin_user_buffer(linkpath, linkpath_len);
+	unpin_user_buffer(target, target_len);
 
 	return success ? 0 : -1;
 }
@@ -603,6 +791,10 @@ syscall_handler (struct intr_frame *f UNUSED) {
 		is_valid_user_ptr(f->R.rdi);
 		f->R.rax = exec(f->R.rdi);
 		break;
+	case SYS_SPAWN:
+		is_valid_user_ptr(f->R.rdi);
+		f->R.rax = spawn(f->R.rdi);
+		break;
 	case SYS_WAIT:	// 4
 		f->R.rax = wait(f->R.rdi);
 		break;
@@ -648,6 +840,22 @@ syscall_handler (struct intr_frame *f UNUSED) {
 		is_valid_user_ptr(f->R.rdi);
 		munmap (f->R.rdi);
 		break;
+	case SYS_MADVISE:
+		is_valid_user_ptr(f->R.rdi);
+		f->R.rax = madvise (f->R.rdi, f->R.rsi, f->R.rdx);
+		break;
+	case SYS_MSYNC:
+		is_valid_user_ptr(f->R.rdi);
+		f->R.rax = msync (f->R.rdi, f->R.rsi, f->R.rdx);
+		break;
+	case SYS_MLOCK:
+		is_valid_user_ptr(f->R.rdi);
+		f->R.rax = mlock (f->R.rdi, f->R.rsi);
+		break;
+	case SYS_MUNLOCK:
+		is_valid_user_ptr(f->R.rdi);
+		f->R.rax = munlock (f->R.rdi, f->R.rsi);
+		break;
 	case SYS_CHDIR:
 		is_valid_user_ptr(f->R.rdi);
 		f->R.rax = chdir(f->R.rdi);
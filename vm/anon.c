@@ -1,9 +1,14 @@
 /* anon.c: Implementation of page for non-disk image (a.k.a. anonymous page). */
 
 #include "vm/vm.h"
+#include "vm/zswap.h"
 #include "devices/disk.h"
 #include "threads/mmu.h"
 #include "threads/synch.h"
+#include "threads/malloc.h"
+#include "threads/thread.h"
+#include <bitmap.h>
+#include <stdio.h>
 
 /* DO NOT MODIFY BELOW LINE */
 static struct disk *swap_disk;
@@ -21,12 +26,17 @@ static const struct page_operations anon_ops = {
 
 static unsigned int SEC_PER_PAGE = PGSIZE / DISK_SECTOR_SIZE;
 struct swap_disk_info {
-	struct hash swapped_page_hash;
+	struct bitmap *used_slots;	/* One bit per page-sized slot. */
+	struct page **slot_pages;	/* Page stored in each used slot. */
 	unsigned int max_number;
 	unsigned int current_using;
-	struct list using_sectors;
 };
 
+/* Swap readahead statistics. */
+static long long swap_major_faults;	/* Swap-ins that had to read the disk. */
+static long long swap_ra_pages;		/* Pages brought in by readahead. */
+static long long swap_ra_hits;		/* Readahead pages used before eviction. */
+
 struct swap_disk_info swap_disk_info;
 struct lock swap_disk_lock;
 
@@ -36,10 +46,32 @@ vm_anon_init (void) {
 	/* TODO: Set up the swap_disk. */
 	lock_init(&swap_disk_lock);
 	swap_disk = disk_get (1, 1);
-	hash_init(&swap_disk_info.swapped_page_hash, page_hash, page_less, NULL);
-	list_init(&swap_disk_info.using_sectors);
-	swap_disk_info.max_number = disk_size(swap_disk) / SEC_PER_PAGE;
+	swap_disk_info.max_number = swap_disk != NULL ? disk_size(swap_disk) / SEC_PER_PAGE : 0;
+	swap_disk_info.used_slots = bitmap_create(swap_disk_info.max_number);
+	if (swap_disk_info.used_slots == NULL)
+		PANIC("cannot allocate swap slot bitmap");
+	swap_disk_info.slot_pages = calloc(swap_disk_info.max_number, sizeof(struct page *));
+	if (swap_disk_info.max_number > 0 && swap_disk_info.slot_pages == NULL)
+		PANIC("cannot allocate swap slot table");
 	swap_disk_info.current_using = 0;
+	zswap_init();
+}
+
+/* Resets the swap readahead state RA. */
+void
+swap_ra_init (struct swap_ra *ra) {
+	ra->cnt = 0;
+	ra->window = SWAP_RA_MAX / 2;
+}
+
+/* Prints swap statistics. */
+void
+anon_print_stats (void) {
+	printf ("Swap: %u slots in use, %lld major faults, "
+			"%lld pages read ahead, %lld readahead hits\n",
+			swap_disk_info.current_using, swap_major_faults,
+			swap_ra_pages, swap_ra_hits);
+	zswap_print_stats (swap_major_faults);
 }
 
 /* Initialize the file mapping */
@@ -49,77 +81,208 @@ anon_initializer (struct page *page, enum vm_type type, void *kva) {
 	page->operations = &anon_ops;
 
 	struct anon_page *anon_page = &page->anon;
+	anon_page->page_sec_idx = SWAP_SLOT_NONE;
+	anon_page->zswap = NULL;
+	anon_page->text_file = NULL;
+	return true;
+}
+
+/* Releases the swap slot held by PAGE.  Must hold swap_disk_lock. */
+static void
+release_swap_slot(struct page *page) {
+	bitmap_reset(swap_disk_info.used_slots, page->anon.page_sec_idx);
+	swap_disk_info.slot_pages[page->anon.page_sec_idx] = NULL;
+	page->anon.page_sec_idx = SWAP_SLOT_NONE;
+	swap_disk_info.current_using--;
+}
+
+/* Counts how many pages of the last readahead of RA were touched and
+ * resizes the window accordingly: doubled when at least half of them
+ * were used, halved otherwise. */
+static void
+swap_ra_update (struct swap_ra *ra) {
+	size_t hits = 0, i;
+
+	if (ra->cnt == 0)
+		return;
+	for (i = 0; i < ra->cnt; i++) {
+		struct page *page = ra->pages[i];
+
+		if (page->frame != NULL && pml4_is_accessed(page->owner->pml4, page->va))
+			hits++;
+	}
+	swap_ra_hits += hits;
+	if (hits * 2 >= ra->cnt)
+		ra->window = ra->window * 2 > SWAP_RA_MAX ? SWAP_RA_MAX : ra->window * 2;
+	else if (ra->window > 1)
+		ra->window /= 2;
+	ra->cnt = 0;
+}
+
+/* Takes PAGE, which is about to be freed, out of the last readahead
+ * of its owner. */
+static void
+swap_ra_forget (struct page *page) {
+	struct swap_ra *ra = &page->owner->spt.ra;
+	size_t i;
+
+	if (ra->cnt == 0)
+		return;
+	lock_acquire(&swap_disk_lock);
+	for (i = 0; i < ra->cnt; i++)
+		if (ra->pages[i] == page) {
+			ra->pages[i] = ra->pages[--ra->cnt];
+			break;
+		}
+	lock_release(&swap_disk_lock);
+}
+
+/* Returns the page of OWNER stored in swap slot SLOT, marked busy, if
+ * it can be read ahead, otherwise NULL.  Must hold swap_disk_lock. */
+static struct page *
+swap_ra_candidate (size_t slot, struct thread *owner) {
+	struct page *page;
+
+	if (slot >= swap_disk_info.max_number)
+		return NULL;
+	page = swap_disk_info.slot_pages[slot];
+	/* A page a child has yet to copy must stay read-only. */
+	if (page == NULL || page->owner != owner || page->fork_pending
+			|| !vm_page_try_busy(page))
+		return NULL;
+	if (page->frame != NULL) {
+		vm_page_unbusy(page);
+		return NULL;
+	}
+	return page;
 }
 
-/* Swap in the page by read contents from the swap disk. */
+/* Swap in the page by read contents from the swap disk.
+ * The slots following the page on disk usually hold its neighbours,
+ * which were evicted in the same batch, so as many of them as the
+ * readahead window allows are read with the same request into free
+ * frames and mapped right away.  Readahead never evicts. */
 static bool
 anon_swap_in (struct page *page, void *kva) {
 	struct anon_page *anon_page = &page->anon;
+	struct swap_ra *ra = &page->owner->spt.ra;
+	struct frame *frames[SWAP_RA_MAX];
+	void *bufs[SWAP_RA_MAX + 1];
+	size_t cnt = 0, window, i;
 
 	page->swapped_out = false;
 
-	if (hash_find(&swap_disk_info.swapped_page_hash, &page->swapped_disk_hash_elem) == NULL)
+	if (zswap_load(page, kva) || anon_page->page_sec_idx == SWAP_SLOT_NONE)
 		return true;
-	
+
 	lock_acquire(&swap_disk_lock);
-	for (int i = 0; i < SEC_PER_PAGE; i++) {
-		disk_read(swap_disk, SEC_PER_PAGE * page->anon.page_sec_idx + i, page->va + DISK_SECTOR_SIZE * i);
+	swap_major_faults++;
+	swap_ra_update(ra);
+	window = ra->window;
+	if (page->advice == VM_ADV_RANDOM)
+		window = 0;
+	else if (page->advice == VM_ADV_SEQUENTIAL)
+		window = SWAP_RA_MAX;
+
+	bufs[0] = kva;
+	while (cnt < window) {
+		struct page *next = swap_ra_candidate(anon_page->page_sec_idx + cnt + 1, page->owner);
+
+		if (next == NULL)
+			break;
+		if ((frames[cnt] = vm_try_get_frame()) == NULL) {
+			vm_page_unbusy(next);
+			break;
+		}
+		bufs[cnt + 1] = frames[cnt]->kva;
+		cnt++;
 	}
-	hash_delete(&swap_disk_info.swapped_page_hash, &page->swapped_disk_hash_elem);
-	list_remove(&page->anon.elem);
-	swap_disk_info.current_using--;
+	disk_read_multiple(swap_disk, SEC_PER_PAGE * anon_page->page_sec_idx, bufs, cnt + 1, SEC_PER_PAGE);
+
+	for (i = 0; i < cnt; i++) {
+		struct page *next = swap_disk_info.slot_pages[anon_page->page_sec_idx + i + 1];
+
+		release_swap_slot(next);
+		next->swapped_out = false;
+		vm_map_frame(next, frames[i]);
+		vm_page_unbusy(next);
+		ra->pages[ra->cnt++] = next;
+	}
+	swap_ra_pages += cnt;
+	release_swap_slot(page);
 	lock_release(&swap_disk_lock);
 
 	return true;
 }
 
-bool
-compare_anon_page(const struct list_elem *e1, const struct list_elem *e2, void *aux UNUSED) {
-	struct anon_page *ap1 = list_entry(e1, struct anon_page, elem);
-	struct anon_page *ap2 = list_entry(e2, struct anon_page, elem);
-	
-	int sec_no1 = ap1->page_sec_idx;
-	int sec_no2 = ap2->page_sec_idx;
-	
-	if (sec_no1 < sec_no2)
-		return true;
-	else
-		return false;
-}
+/* Writes the CNT pages in PAGES, whose contents are at BUFS, to swap
+ * with as few disk requests as possible.  The pages are given a run
+ * of contiguous swap slots and written with one multi-sector request,
+ * so that a later swap-in can bring the neighbours back cheaply.  If
+ * the swap disk is too fragmented for a run of CNT slots, the pages
+ * are split into smaller runs. */
+static void
+swap_write (struct page **pages, void **bufs, size_t cnt) {
+	size_t done = 0, run, slot, i;
 
-/* Swap out the page by writing contents to the swap disk. */
-static bool
-anon_swap_out (struct page *page) {
-	struct anon_page *anon_page = &page->anon;
-	unsigned int sec_idx = 0;
-	struct list_elem* el;
-	struct anon_page* ap;
-
-	if (swap_disk_info.max_number <= swap_disk_info.current_using)
-		PANIC("No more swap disk slot, max: %d, curr: %d\n", swap_disk_info.max_number, swap_disk_info.current_using);
-
-	if (list_size(&swap_disk_info.using_sectors) > 0) {
-		el = list_begin(&swap_disk_info.using_sectors);
-		while (el != list_end(&swap_disk_info.using_sectors)) {
-			ap = list_entry(el, struct anon_page, elem);
-			if (sec_idx != ap->page_sec_idx)
-				break;
-			sec_idx++;
-			el = el->next;
+	lock_acquire(&swap_disk_lock);
+	while (done < cnt) {
+		run = cnt - done;
+		while ((slot = bitmap_scan_and_flip(swap_disk_info.used_slots, 0, run, false)) == BITMAP_ERROR) {
+			if (run == 1)
+				PANIC("No more swap disk slot, max: %d, curr: %d\n", swap_disk_info.max_number, swap_disk_info.current_using);
+			run /= 2;
 		}
-	}
+		for (i = 0; i < run; i++) {
+			struct page *page = pages[done + i];
 
-	lock_acquire(&swap_disk_lock);
-	for (int i = 0; i < SEC_PER_PAGE; i++) {
-		disk_write(swap_disk, SEC_PER_PAGE * sec_idx + i, page->va + DISK_SECTOR_SIZE * i);
+			page->anon.page_sec_idx = slot + i;
+			swap_disk_info.slot_pages[slot + i] = page;
+			page->swapped_out = true;
+		}
+		disk_write_multiple(swap_disk, SEC_PER_PAGE * slot, bufs + done, run, SEC_PER_PAGE);
+		swap_disk_info.current_using += run;
+		done += run;
 	}
-	page->anon.page_sec_idx = sec_idx;
-	list_insert_ordered(&swap_disk_info.using_sectors, &page->anon.elem, compare_anon_page, NULL);
-	hash_insert(&swap_disk_info.swapped_page_hash, &page->swapped_disk_hash_elem);
-	swap_disk_info.current_using++;
-	page->swapped_out = true;
 	lock_release(&swap_disk_lock);
+}
+
+/* Swap out the CNT anonymous pages in PAGES, which are still
+ * attached to their frames.  Pages that compress well are kept in
+ * the zswap pool; the others go to the disk together. */
+void
+anon_swap_out_cluster (struct page **pages, size_t cnt) {
+	struct page *disk_pages[SWAP_CLUSTER_MAX];
+	void *bufs[SWAP_CLUSTER_MAX];
+	size_t disk_cnt = 0, i;
+
+	ASSERT (cnt <= SWAP_CLUSTER_MAX);
+
+	for (i = 0; i < cnt; i++) {
+		struct page *page = pages[i];
+
+		ASSERT (page->frame != NULL);
+		if (zswap_store(page, page->frame->kva)) {
+			page->swapped_out = true;
+			continue;
+		}
+		disk_pages[disk_cnt] = page;
+		bufs[disk_cnt++] = page->frame->kva;
+	}
+	if (disk_cnt > 0)
+		swap_write(disk_pages, bufs, disk_cnt);
+}
+
+/* Writes PAGE, whose contents are in BUF, to its own swap slot. */
+void
+anon_swap_out_buffer (struct page *page, void *buf) {
+	swap_write(&page, &buf, 1);
+}
 
+/* Swap out the page by writing contents to the swap disk. */
+static bool
+anon_swap_out (struct page *page) {
+	anon_swap_out_cluster(&page, 1);
 	return true;
 }
 
@@ -128,13 +291,17 @@ static void
 anon_destroy (struct page *page) {
 	struct anon_page *anon_page = &page->anon;
 
+	swap_ra_forget(page);
+	if (anon_page->text_file != NULL)
+		file_close(anon_page->text_file);
 	if (page->frame != NULL)
 		common_clear_page(page);
 	else {
+		zswap_invalidate(page);
+		if (anon_page->page_sec_idx == SWAP_SLOT_NONE)
+			return;
 		lock_acquire(&swap_disk_lock);
-		hash_delete(&swap_disk_info.swapped_page_hash, &page->swapped_disk_hash_elem);
-		list_remove(&page->anon.elem);
-		swap_disk_info.current_using--;
+		release_swap_slot(page);
 		lock_release(&swap_disk_lock);
 	}
 }
@@ -4,6 +4,7 @@
 #include "threads/mmu.h"
 #include "threads/synch.h"
 #include "threads/vaddr.h"
+#include <round.h>
 
 static bool file_backed_swap_in (struct page *page, void *kva);
 static bool file_backed_swap_out (struct page *page);
@@ -39,7 +40,6 @@ copy_file_page(struct file_page* src, struct file_page* dst) {
 	// lock_acquire(&filesys_lock);
 	dst->file = src->file;
 	// lock_release(&filesys_lock);
-	dst->is_last = src->is_last;
 	dst->data_bytes = src->data_bytes;
 	dst->zero_bytes = src->zero_bytes;
 	dst->offset = src->offset;
@@ -53,10 +53,11 @@ file_backed_swap_in (struct page *page, void *kva) {
 		return false;
 
 	lock_acquire(&filesys_lock);
-	file_read_at(file_page->file, page->va, file_page->data_bytes, file_page->offset);
+	file_read_at(file_page->file, kva, file_page->data_bytes, file_page->offset);
 	lock_release(&filesys_lock);
 	if (file_page->zero_bytes > 0)
-		memset(page->va + file_page->data_bytes, 0, file_page->zero_bytes);
+		memset(kva + file_page->data_bytes, 0, file_page->zero_bytes);
+	page->swapped_out = false;
 	return true;
 }
 
@@ -65,11 +66,11 @@ static bool
 file_backed_swap_out (struct page *page) {
 	struct file_page *file_page UNUSED = &page->file;
 
-	if (file_page->file == NULL)
+	if (file_page->file == NULL || page->frame == NULL)
 		return false;
 
 	lock_acquire(&filesys_lock);
-	file_write_at(file_page->file, page->va, file_page->data_bytes, file_page->offset);
+	file_write_at(file_page->file, page->frame->kva, file_page->data_bytes, file_page->offset);
 	lock_release(&filesys_lock);
 	return true;
 }
@@ -79,14 +80,19 @@ static void
 file_backed_destroy (struct page *page) {
 	struct file_page *file_page UNUSED = &page->file;
 
-	if (!page->swapped_out) {
+	if (page->frame != NULL && ((page->frame->flags & FRAME_DIRTY)
+				|| pml4_is_dirty(page->owner->pml4, page->va)))
 		file_backed_swap_out(page);
-	}
 	if (page->frame != NULL)
 		common_clear_page(page);
+	if (file_page->file != NULL) {
+		lock_acquire(&filesys_lock);
+		file_close(file_page->file);
+		lock_release(&filesys_lock);
+	}
 }
 
-void
+bool
 mmap_set_page(struct page *page, void *aux) {
 	struct mmap_parameter *params = (struct mmap_parameter *)aux;
 
@@ -94,91 +100,64 @@ mmap_set_page(struct page *page, void *aux) {
 	page->file.file = params->file;
 	page->file.offset = params->offset;
 	page->file.zero_bytes = params->zero_bytes;
-	page->file.is_last = params->is_last;
-	free(aux);
+	kmem_cache_free(mmap_parameter_slab, aux);
+	return true;
 }
 
 void *
 copy_mmap_parameter(struct page* src, void* dst) {
-	struct mmap_parameter* aux = malloc(sizeof(struct mmap_parameter));
+	struct mmap_parameter* aux = kmem_cache_alloc(mmap_parameter_slab);
 	struct mmap_parameter *src_aux = (struct mmap_parameter *)src->uninit.aux;
 
-	aux->file = src_aux->file;
+	aux->file = file_reopen(src_aux->file);
 	aux->offset = src_aux->offset;
 	aux->data_bytes = src_aux->data_bytes;
 	aux->zero_bytes = src_aux->zero_bytes;
-	aux->is_last = src_aux->is_last;
 
 	return aux;
 }
 
-/* Do the mmap */
+/* Do the mmap.  Only a region is recorded here; each page is
+ * created by the first fault on it. */
 void *
 do_mmap (void *addr, size_t length, int writable,
 		struct file *file, off_t offset) {
-	size_t page_number = length / PGSIZE + (length % PGSIZE == 0 ? 0 : 1);
-	size_t left_size = length;
-	struct mmap_parameter *aux;
+	struct supplemental_page_table *spt = &thread_current()->spt;
+	void *end = addr + ROUND_UP(length, PGSIZE);
+	struct file *region_file;
 
 	if (file_length(file) <= offset)	// 글쎄??
 		return NULL;
+	if (end <= addr || !is_user_vaddr(end - 1))
+		return NULL;
+	if (region_overlaps(&spt->regions, addr, end) || !spt_range_empty(spt, addr, end))
+		return NULL;
 
-	for (int i = 0; i < page_number; i++) {
-		if (addr + PGSIZE * i == NULL || is_kernel_vaddr(addr + PGSIZE * i))
-			return NULL;
-		if (spt_find_page(&thread_current()->spt, addr + PGSIZE * i) != NULL)
-			return NULL;
-	}
-
-	for (int i = 0; i < page_number; i++) {
-		aux = malloc(sizeof(struct mmap_parameter));
-		lock_acquire(&filesys_lock);
-		aux->file = file_reopen(file);
-		lock_release(&filesys_lock);
-		aux->offset = offset + PGSIZE * i;
-		if (left_size >= PGSIZE) {
-			aux->data_bytes = PGSIZE;
-			aux->zero_bytes = 0;
-			aux->is_last = left_size == PGSIZE ? true : false;
-		} else {
-			aux->data_bytes = left_size;
-			aux->zero_bytes = PGSIZE - left_size;
-			aux->is_last = true;
-		}
-		if (vm_alloc_page_with_initializer(VM_FILE, addr + PGSIZE * i, writable, mmap_set_page, aux) == NULL)
-			return NULL;
-		left_size -= PGSIZE;
+	lock_acquire(&filesys_lock);
+	region_file = file_reopen(file);
+	lock_release(&filesys_lock);
+	if (region_file == NULL)
+		return NULL;
+	if (!region_add(&spt->regions, addr, end, region_file, offset, length,
+				VM_FILE, writable, mmap_set_page)) {
+		file_close(region_file);
+		return NULL;
 	}
 	return addr;
 }
 
-/* Do the munmap */
+/* Do the munmap.  Unmaps ADDR and the rest of the mapping that holds
+ * it; the pages that were touched are written back if dirty. */
 void
 do_munmap (void *addr) {
-	struct page* page;
-	struct file_page* fp;
-	void* curr_addr = addr;
-
-	while (true) {
-		page = spt_find_page(&thread_current()->spt, curr_addr);
-		if (page == NULL || page_get_type(page) == VM_ANON)
-			exit(-1);
-
-		fp = &page->file;
-		if (VM_TYPE(page->operations->type) == VM_FILE && pml4_is_dirty(thread_current()->pml4, page->va)) {
-			lock_acquire(&filesys_lock);
-			file_write_at(fp->file, page->va, fp->data_bytes, fp->offset);
-			lock_release(&filesys_lock);
-		} 
-		if (VM_TYPE(page->operations->type) == VM_FILE && fp->file != NULL) {
-			lock_acquire(&filesys_lock);
-			file_close(fp->file);
-			lock_release(&filesys_lock);
-		}
-		fp->file = NULL;
-		
-		if (fp->is_last)
-			break;
-		curr_addr += PGSIZE;
-	}
+	struct supplemental_page_table *spt = &thread_current()->spt;
+	struct vm_region *region = region_find(&spt->regions, addr);
+	void *end;
+
+	if (region == NULL || VM_TYPE(region->type) != VM_FILE)
+		exit(-1);
+
+	end = region_map_end(&spt->regions, region);
+	vm_drop_range(addr, end);
+	region_remove(&spt->regions, addr, end);
 }
@@ -0,0 +1,468 @@
+/* region.c: Regions of an address space, kept in an AVL tree so that a
+ * fault finds the region of its address in O(log n). */
+
+#include "vm/vm.h"
+#include "vm/region.h"
+#include "filesys/file.h"
+#include "threads/malloc.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+
+static int
+height (struct vm_region *r) {
+	return r != NULL ? r->height : 0;
+}
+
+static void
+update_height (struct vm_region *r) {
+	int l = height(r->left), h = height(r->right);
+
+	r->height = (l > h ? l : h) + 1;
+}
+
+static struct vm_region *
+rotate_right (struct vm_region *r) {
+	struct vm_region *l = r->left;
+
+	r->left = l->right;
+	l->right = r;
+	update_height(r);
+	update_height(l);
+	return l;
+}
+
+static struct vm_region *
+rotate_left (struct vm_region *r) {
+	struct vm_region *h = r->right;
+
+	r->right = h->left;
+	h->left = r;
+	update_height(r);
+	update_height(h);
+	return h;
+}
+
+/* Restores the balance of the subtree rooted at R, whose own subtrees
+ * are balanced, and returns its new root. */
+static struct vm_region *
+rebalance (struct vm_region *r) {
+	int bal;
+
+	update_height(r);
+	bal = height(r->left) - height(r->right);
+	if (bal > 1) {
+		if (height(r->left->left) < height(r->left->right))
+			r->left = rotate_left(r->left);
+		return rotate_right(r);
+	}
+	if (bal < -1) {
+		if (height(r->right->right) < height(r->right->left))
+			r->right = rotate_right(r->right);
+		return rotate_left(r);
+	}
+	return r;
+}
+
+static struct vm_region *
+tree_insert (struct vm_region *root, struct vm_region *r) {
+	if (root == NULL) {
+		r->left = r->right = NULL;
+		r->height = 1;
+		return r;
+	}
+	if (r->start < root->start)
+		root->left = tree_insert(root->left, r);
+	else
+		root->right = tree_insert(root->right, r);
+	return rebalance(root);
+}
+
+/* Unlinks the leftmost region of ROOT and stores it in *MIN. */
+static struct vm_region *
+tree_remove_min (struct vm_region *root, struct vm_region **min) {
+	if (root->left == NULL) {
+		*min = root;
+		return root->right;
+	}
+	root->left = tree_remove_min(root->left, min);
+	return rebalance(root);
+}
+
+static struct vm_region *
+tree_delete (struct vm_region *root, struct vm_region *r) {
+	struct vm_region *min, *right;
+
+	if (root == r) {
+		if (r->right == NULL)
+			return r->left;
+		right = tree_remove_min(r->right, &min);
+		min->left = r->left;
+		min->right = right;
+		return rebalance(min);
+	}
+	if (r->start < root->start)
+		root->left = tree_delete(root->left, r);
+	else
+		root->right = tree_delete(root->right, r);
+	return rebalance(root);
+}
+
+/* Returns the region that holds VA or, if none does, the lowest
+ * region above VA.  NULL if there is neither. */
+static struct vm_region *
+region_lookup (struct region_tree *tree, void *va) {
+	struct vm_region *r = tree->root, *above = NULL;
+
+	while (r != NULL) {
+		if (va < r->start) {
+			above = r;
+			r = r->left;
+		} else if (va < r->end)
+			return r;
+		else
+			r = r->right;
+	}
+	return above;
+}
+
+/* Returns the highest region that starts below VA, or NULL. */
+static struct vm_region *
+region_lookup_below (struct region_tree *tree, void *va) {
+	struct vm_region *r = tree->root, *below = NULL;
+
+	while (r != NULL) {
+		if (r->start < va) {
+			below = r;
+			r = r->right;
+		} else
+			r = r->left;
+	}
+	return below;
+}
+
+static void
+region_free (struct vm_region *r) {
+	if (r->file != NULL)
+		file_close(r->file);
+	free(r);
+}
+
+void
+region_tree_init (struct region_tree *tree) {
+	tree->root = NULL;
+	tree->cnt = 0;
+}
+
+/* Returns the region that holds VA, or NULL. */
+struct vm_region *
+region_find (struct region_tree *tree, void *va) {
+	struct vm_region *r = region_lookup(tree, va);
+
+	return r != NULL && r->start <= va ? r : NULL;
+}
+
+/* Returns the region that holds VA or else the lowest one above it,
+ * or NULL. */
+struct vm_region *
+region_find_next (struct region_tree *tree, void *va) {
+	return region_lookup(tree, va);
+}
+
+/* Returns the end of the mmap whose lowest remaining region is R.
+ * madvise may have split the mmap into several regions. */
+void *
+region_map_end (struct region_tree *tree, struct vm_region *r) {
+	struct vm_region *next;
+
+	while ((next = region_lookup(tree, r->end)) != NULL
+			&& next->start == r->end && next->mmap_cont)
+		r = next;
+	return r->end;
+}
+
+/* Returns true if some region overlaps [START, END). */
+bool
+region_overlaps (struct region_tree *tree, void *start, void *end) {
+	struct vm_region *r = region_lookup(tree, start);
+
+	return r != NULL && r->start < end;
+}
+
+/* Returns true if HI, which starts where LO ends, continues LO, so
+ * that both can be one region.  Mmaps are never merged: munmap takes
+ * no length, so each mmap has to keep its own end. */
+static bool
+can_merge (struct vm_region *lo, struct vm_region *hi) {
+	if (lo->end != hi->start || lo->type != hi->type
+			|| lo->writable != hi->writable || lo->init != hi->init
+			|| lo->advice != hi->advice
+			|| VM_TYPE(lo->type) == VM_FILE)
+		return false;
+	if (lo->file == NULL || hi->file == NULL)
+		return lo->file == NULL && hi->file == NULL;
+	return file_get_inode(lo->file) == file_get_inode(hi->file)
+			&& lo->file_bytes == (size_t) (lo->end - lo->start)
+			&& lo->offset + (off_t) lo->file_bytes == hi->offset;
+}
+
+/* Adds the region [START, END) to TREE, merging it with its
+ * neighbours when they continue each other.  The region takes over
+ * FILE, which may be NULL.  Returns false, leaving FILE to the
+ * caller, if the range overlaps a region or memory runs out. */
+bool
+region_add (struct region_tree *tree, void *start, void *end,
+		struct file *file, off_t offset, size_t file_bytes,
+		enum vm_type type, bool writable, vm_initializer *init) {
+	struct vm_region *r, *lo, *hi;
+
+	ASSERT (pg_ofs(start) == 0 && pg_ofs(end) == 0);
+	ASSERT (start < end);
+
+	if (region_overlaps(tree, start, end))
+		return false;
+	r = malloc(sizeof(struct vm_region));
+	if (r == NULL)
+		return false;
+	r->start = start;
+	r->end = end;
+	r->file = file;
+	r->offset = offset;
+	r->file_bytes = file_bytes;
+	r->type = type;
+	r->writable = writable;
+	r->init = init;
+	r->advice = VM_ADV_NORMAL;
+	r->mmap_cont = false;
+
+	lo = region_lookup_below(tree, start);
+	if (lo != NULL && can_merge(lo, r)) {
+		lo->end = r->end;
+		lo->file_bytes += r->file_bytes;
+		region_free(r);
+		r = lo;
+	} else {
+		tree->root = tree_insert(tree->root, r);
+		tree->cnt++;
+	}
+
+	hi = region_lookup(tree, end);
+	if (hi != NULL && hi->start == end && can_merge(r, hi)) {
+		tree->root = tree_delete(tree->root, hi);
+		tree->cnt--;
+		r->end = hi->end;
+		r->file_bytes += hi->file_bytes;
+		region_free(hi);
+	}
+	return true;
+}
+
+/* Moves the start of R up to START. */
+static void
+trim_front (struct vm_region *r, void *start) {
+	size_t delta = (uint8_t *) start - (uint8_t *) r->start;
+
+	r->start = start;
+	r->offset += delta;
+	r->file_bytes = r->file_bytes > delta ? r->file_bytes - delta : 0;
+}
+
+/* Moves the end of R down to END. */
+static void
+trim_back (struct vm_region *r, void *end) {
+	size_t size = (uint8_t *) end - (uint8_t *) r->start;
+
+	r->end = end;
+	if (r->file_bytes > size)
+		r->file_bytes = size;
+}
+
+/* Removes [START, END) from the regions of TREE, shrinking or
+ * splitting the regions that are only partly inside.  The pages of
+ * the range must be gone already.  If a region cannot be split for
+ * lack of memory, its upper part is left mapped. */
+void
+region_remove (struct region_tree *tree, void *start, void *end) {
+	struct vm_region *r, *hi;
+
+	while ((r = region_lookup(tree, start)) != NULL && r->start < end) {
+		if (r->start < start && r->end > end) {
+			/* A hole in the middle: the part above it gets its own
+			 * region and its own file. */
+			hi = malloc(sizeof(struct vm_region));
+			if (hi == NULL)
+				return;
+			*hi = *r;
+			if (r->file != NULL && (hi->file = file_reopen(r->file)) == NULL) {
+				free(hi);
+				return;
+			}
+			trim_front(hi, end);
+			trim_back(r, start);
+			tree->root = tree_insert(tree->root, hi);
+			tree->cnt++;
+			return;
+		}
+		if (r->start < start)
+			trim_back(r, start);
+		else if (r->end > end) {
+			trim_front(r, end);
+			return;
+		} else {
+			tree->root = tree_delete(tree->root, r);
+			tree->cnt--;
+			region_free(r);
+		}
+	}
+}
+
+/* Splits the region that holds VA in two at VA, unless it starts
+ * there.  Returns false if memory runs out. */
+static bool
+region_split (struct region_tree *tree, void *va) {
+	struct vm_region *r = region_find(tree, va), *hi;
+
+	if (r == NULL || r->start == va)
+		return true;
+	hi = malloc(sizeof(struct vm_region));
+	if (hi == NULL)
+		return false;
+	*hi = *r;
+	if (r->file != NULL && (hi->file = file_reopen(r->file)) == NULL) {
+		free(hi);
+		return false;
+	}
+	trim_front(hi, va);
+	trim_back(r, va);
+	if (VM_TYPE(r->type) == VM_FILE)
+		hi->mmap_cont = true;
+	tree->root = tree_insert(tree->root, hi);
+	tree->cnt++;
+	return true;
+}
+
+/* Gives ADVICE to the regions in [START, END), splitting the ones
+ * that are only partly inside.  Returns false if memory runs out. */
+bool
+region_advise (struct region_tree *tree, void *start, void *end,
+		enum vm_advice advice) {
+	struct vm_region *r;
+
+	if (!region_split(tree, start) || !region_split(tree, end))
+		return false;
+	for (r = region_lookup(tree, start); r != NULL && r->start < end;
+			r = region_lookup(tree, r->end))
+		r->advice = advice;
+	return true;
+}
+
+static bool
+copy_subtree (struct region_tree *dst, struct vm_region *r) {
+	struct vm_region *copy;
+
+	if (r == NULL)
+		return true;
+	copy = malloc(sizeof(struct vm_region));
+	if (copy == NULL)
+		return false;
+	*copy = *r;
+	if (r->file != NULL && (copy->file = file_reopen(r->file)) == NULL) {
+		free(copy);
+		return false;
+	}
+	dst->root = tree_insert(dst->root, copy);
+	dst->cnt++;
+	return copy_subtree(dst, r->left) && copy_subtree(dst, r->right);
+}
+
+/* Copies the regions of SRC into DST, which must be empty. */
+bool
+region_tree_copy (struct region_tree *dst, struct region_tree *src) {
+	ASSERT (dst->root == NULL);
+	return copy_subtree(dst, src->root);
+}
+
+static void
+destroy_subtree (struct vm_region *r) {
+	if (r == NULL)
+		return;
+	destroy_subtree(r->left);
+	destroy_subtree(r->right);
+	region_free(r);
+}
+
+/* Frees every region of TREE, which is left empty. */
+void
+region_tree_destroy (struct region_tree *tree) {
+	destroy_subtree(tree->root);
+	region_tree_init(tree);
+}
+
+/* Creates the page at VA, which lies in REGION, in the page table of
+ * the current process, the way it would have been created up front,
+ * or copies it from the parent that forked us.  Returns the new page,
+ * or NULL if memory runs out. */
+struct page *
+region_fault_in (struct vm_region *region, void *va) {
+	size_t rel = (uint8_t *) va - (uint8_t *) region->start;
+	size_t read_bytes = 0;
+	struct file *file;
+	struct page *page;
+	bool succ;
+
+	ASSERT (pg_ofs(va) == 0);
+
+	if (!fork_pull(va, &page))
+		return NULL;
+	if (page != NULL)
+		return page;
+
+	if (region->file != NULL && region->file_bytes > rel)
+		read_bytes = region->file_bytes - rel < PGSIZE ? region->file_bytes - rel : PGSIZE;
+	if (read_bytes == 0 && VM_TYPE(region->type) == VM_ANON) {
+		if (vm_alloc_page(VM_ANON | VM_ZERO_FILL, va, region->writable))
+			page = spt_find_page(&thread_current()->spt, va);
+		goto done;
+	}
+
+	if ((file = file_reopen(region->file)) == NULL)
+		return NULL;
+	if (VM_TYPE(region->type) == VM_FILE) {
+		struct mmap_parameter *aux = kmem_cache_alloc(mmap_parameter_slab);
+
+		if (aux == NULL) {
+			file_close(file);
+			return NULL;
+		}
+		aux->file = file;
+		aux->offset = region->offset + rel;
+		aux->data_bytes = read_bytes;
+		aux->zero_bytes = PGSIZE - read_bytes;
+		succ = vm_alloc_page_with_initializer(region->type, va, region->writable, region->init, aux);
+		if (!succ)
+			kmem_cache_free(mmap_parameter_slab, aux);
+	} else {
+		struct lazy_parameter *aux = kmem_cache_alloc(lazy_parameter_slab);
+
+		if (aux == NULL) {
+			file_close(file);
+			return NULL;
+		}
+		aux->file = file;
+		aux->ofs = region->offset + rel;
+		aux->read_bytes = read_bytes;
+		aux->zero_bytes = PGSIZE - read_bytes;
+		aux->upage = va;
+		succ = vm_alloc_page_with_initializer(region->type, va, region->writable, region->init, aux);
+		if (!succ)
+			kmem_cache_free(lazy_parameter_slab, aux);
+	}
+	if (!succ) {
+		file_close(file);
+		return NULL;
+	}
+	page = spt_find_page(&thread_current()->spt, va);
+done:
+	if (page != NULL)
+		page->advice = region->advice;
+	return page;
+}
@@ -10,6 +10,9 @@
 
 #include "vm/vm.h"
 #include "vm/uninit.h"
+#include "threads/synch.h"
+
+extern struct lock filesys_lock;
 
 static bool uninit_initialize (struct page *page, void *kva);
 static void uninit_destroy (struct page *page);
@@ -65,6 +68,25 @@ uninit_destroy (struct page *page) {
 	struct uninit_page *uninit UNUSED = &page->uninit;
 	/* TODO: Fill this function.
 	 * TODO: If you don't have anything to do, just return. */
-	free(uninit->aux);
-	return;
+	if (uninit->aux == NULL)
+		return;
+	if (VM_TYPE(uninit->type) == VM_ANON) {
+		struct lazy_parameter *params = uninit->aux;
+
+		if (params->file != NULL) {
+			lock_acquire(&filesys_lock);
+			file_close(params->file);
+			lock_release(&filesys_lock);
+		}
+		kmem_cache_free(lazy_parameter_slab, params);
+	} else {
+		struct mmap_parameter *params = uninit->aux;
+
+		if (params->file != NULL) {
+			lock_acquire(&filesys_lock);
+			file_close(params->file);
+			lock_release(&filesys_lock);
+		}
+		kmem_cache_free(mmap_parameter_slab, params);
+	}
 }
@@ -4,16 +4,149 @@
 #include "vm/vm.h"
 #include "vm/inspect.h"
 #include <hash.h>
+#include <round.h>
 #include "threads/mmu.h"
 #include "threads/synch.h"
+#include <stdio.h>
 #include <string.h>
 #include "userprog/process.h"
+#include "devices/timer.h"
+#include "filesys/inode.h"
 
-struct lock hash_lock;
+/* Descriptors of the frames of the user pool, by frame number. */
+static struct frame *frame_table;
+static size_t frame_cnt;
+static uint64_t frame_base_pfn;		/* Frame number of frame_table[0]. */
+
+/* Frames that hold user pages, most recently mapped first.  Frames
+ * being filled by a fault are added only once they are mapped. */
 struct list frames_list;
 extern struct lock filesys_lock;
-struct lock cow_lock;
-struct lock handle_fault_lock;
+
+/* Protects frames_list, the referers of every frame, page->frame and
+ * page->busy.  Never held across disk I/O. */
+static struct lock frame_lock;
+/* Signalled, with frame_lock, whenever a page stops being busy. */
+static struct condition page_idle;
+
+/* Read-only frame of zeros shared by every untouched zero-fill page.
+ * It is pinned and never on frames_list, so it is never evicted nor
+ * freed. */
+static struct frame *zero_frame;
+
+/* Background reclaim. */
+size_t vm_low_watermark = 16;
+size_t vm_high_watermark = 32;
+static struct semaphore kswapd_sema;
+static long long kswapd_reclaimed;	/* Pages freed by the reclaim thread. */
+static long long direct_reclaims;	/* Evictions done by a faulting thread. */
+static void kswapd (void *aux);
+
+/* Frames of VM_TEXT pages, keyed by inode and offset, so that every
+ * process running an executable maps the same frames.  A frame leaves
+ * the table when its last referer goes away or when it is evicted.
+ * Protected by frame_lock. */
+static struct hash text_table;
+static long long text_shared;	/* Text faults served from the table. */
+static long long text_reads;	/* Text pages read from the file. */
+
+/* Faults of file mappings served from the page cache. */
+static long long cache_mapped;
+
+/* Fault-around. */
+size_t vm_fault_around = 16;
+static long long fault_around_pages;	/* Pages mapped around a fault. */
+
+/* Writeback of file mappings. */
+size_t vm_writeback_secs = 5;
+static long long writeback_pages;	/* Dirty mmap pages written back. */
+static long long writeback_runs;	/* Writes of adjacent pages they took. */
+static void flushd (void *aux);
+
+/* Most pages written back together. */
+#define WRITEBACK_RUN_MAX 16
+
+/* Same-page merging.  Frames whose contents are fixed are kept in
+ * ksm_table by checksum; a frame found with the same contents as one
+ * of them gives its pages to it.  Protected by frame_lock. */
+size_t vm_ksm_pages = 0;
+static struct hash ksm_table;
+static long long ksm_scanned;	/* Frames looked at. */
+static long long ksm_passes;	/* Passes over the whole frame table. */
+static long long ksm_merged;	/* Pages moved onto a frame of the table. */
+static void ksmd (void *aux);
+
+/* Time between two batches of vm_ksm_pages frames. */
+#define KSM_INTERVAL (TIMER_FREQ / 10)
+
+/* Pinning. */
+static long long buffer_pins;	/* User pages pinned for kernel I/O. */
+static size_t mlocked_pages;	/* Pages pinned by mlock. */
+
+/* madvise() and MAP_POPULATE. */
+static long long populated_pages;	/* Pages brought in ahead of faults. */
+static long long dropped_pages;		/* Pages dropped by munmap or MADV_DONTNEED. */
+
+/* Copy-on-write faults. */
+static long long cow_copied;	/* Faults that copied a shared frame. */
+static long long cow_reused;	/* Faults by the last page on its frame. */
+
+/* Huge pages. */
+bool vm_huge_pages = true;
+static long long huge_mapped;		/* 2 MB blocks mapped with one entry. */
+static long long huge_fallbacks;	/* Blocks that got 4 KB pages instead. */
+static long long huge_torn_down;	/* Blocks unmapped because a split failed. */
+
+#define HUGE_PAGE_CNT (HUGE_PGSIZE / PGSIZE)
+
+/* The supplemental page table is a radix tree of four levels of 128
+ * slots, indexed by 7-bit fields of the page number, whose last level
+ * points to the pages.  That covers 2**40 bytes, more than all of user
+ * space.  Nodes are 1 kB objects of spt_node_slab, allocated on first
+ * use and freed once they are empty again, so a small process needs a
+ * few kB rather than a page per node. */
+#define SPT_LEVELS 4
+#define SPT_BITS 7
+#define SPT_SLOTS (1 << SPT_BITS)
+#define SPT_NODE_SIZE (SPT_SLOTS * sizeof (void *))
+
+/* Object caches. */
+struct kmem_cache *page_slab;
+struct kmem_cache *lazy_parameter_slab;
+struct kmem_cache *mmap_parameter_slab;
+static struct kmem_cache *spt_node_slab;
+static void spt_node_init (void *node);
+
+static uint64_t text_hash (const struct hash_elem *e, void *aux);
+static bool text_less (const struct hash_elem *a, const struct hash_elem *b, void *aux);
+static uint64_t ksm_hash (const struct hash_elem *e, void *aux);
+static bool ksm_less (const struct hash_elem *a, const struct hash_elem *b, void *aux);
+
+/* Allocates a descriptor for every frame of the user pool. */
+static void
+frame_table_init (void) {
+	void *base;
+	size_t i;
+
+	palloc_user_range(&base, &frame_cnt);
+	frame_base_pfn = pg_no(vtop(base));
+	frame_table = palloc_get_multiple(PAL_ZERO | PAL_ASSERT,
+			DIV_ROUND_UP(frame_cnt * sizeof(struct frame), PGSIZE));
+	for (i = 0; i < frame_cnt; i++) {
+		frame_table[i].kva = (uint8_t *) base + i * PGSIZE;
+		list_init(&frame_table[i].referers);
+	}
+}
+
+/* Returns the descriptor of the frame of the user pool at kernel
+ * address KVA. */
+struct frame *
+vm_frame_of (void *kva) {
+	uint64_t pfn = pg_no(vtop(kva));
+
+	ASSERT (pfn - frame_base_pfn < frame_cnt);
+	return &frame_table[pfn - frame_base_pfn];
+}
 
 /* Initializes the virtual memory subsystem by invoking each subsystem's
  * intialize codes. */
@@ -27,10 +160,55 @@ vm_init (void) {
 	register_inspect_intr ();
 	/* DO NOT MODIFY UPPER LINES. */
 	/* TODO: Your code goes here. */
-	lock_init(&hash_lock);
-	lock_init(&cow_lock);
+	page_slab = kmem_cache_create("page", sizeof(struct page), NULL);
+	lazy_parameter_slab = kmem_cache_create("lazy_parameter",
+			sizeof(struct lazy_parameter), NULL);
+	mmap_parameter_slab = kmem_cache_create("mmap_parameter",
+			sizeof(struct mmap_parameter), NULL);
+	spt_node_slab = kmem_cache_create("spt_node", SPT_NODE_SIZE, spt_node_init);
+	frame_table_init();
 	list_init(&frames_list);
-	lock_init(&handle_fault_lock);
+	hash_init(&text_table, text_hash, text_less, NULL);
+	hash_init(&ksm_table, ksm_hash, ksm_less, NULL);
+	lock_init(&frame_lock);
+	cond_init(&page_idle);
+	zero_frame = vm_frame_of(palloc_get_page(PAL_USER | PAL_ZERO | PAL_ASSERT));
+	zero_frame->pin_cnt = 1;
+	/* Pages of zeros merge into the zero frame. */
+	zero_frame->ksm_sum = hash_bytes(zero_frame->kva, PGSIZE);
+	zero_frame->flags |= FRAME_KSM;
+	hash_insert(&ksm_table, &zero_frame->ksm_elem);
+
+	if (vm_high_watermark < vm_low_watermark)
+		vm_high_watermark = vm_low_watermark;
+	sema_init(&kswapd_sema, 0);
+	thread_create("kswapd", PRI_DEFAULT, kswapd, NULL);
+	if (vm_writeback_secs > 0)
+		thread_create("flushd", PRI_DEFAULT, flushd, NULL);
+	if (vm_ksm_pages > 0)
+		thread_create("ksmd", PRI_MIN, ksmd, NULL);
+}
+
+/* Prints virtual memory statistics. */
+void
+vm_print_stats (void) {
+	printf ("Reclaim: %lld pages by kswapd, %lld direct reclaims\n",
+			kswapd_reclaimed, direct_reclaims);
+	printf ("Fault-around: %lld pages mapped\n", fault_around_pages);
+	printf ("Madvise: %lld pages populated, %lld pages dropped\n",
+			populated_pages, dropped_pages);
+	printf ("Writeback: %lld pages in %lld runs\n", writeback_pages, writeback_runs);
+	printf ("Pins: %lld buffer pages pinned, %zu pages mlocked\n",
+			buffer_pins, mlocked_pages);
+	printf ("Huge pages: %lld blocks mapped, %lld fell back to 4 KB pages, "
+			"%lld torn down\n", huge_mapped, huge_fallbacks, huge_torn_down);
+	printf ("Text: %lld pages shared, %lld pages read\n", text_shared, text_reads);
+	printf ("KSM: %lld frames scanned in %lld passes (%zu per 100 ms), "
+			"%lld pages merged into %zu frames\n", ksm_scanned, ksm_passes,
+			vm_ksm_pages, ksm_merged, hash_size(&ksm_table));
+	page_cache_print_stats (cache_mapped);
+	printf ("COW: %lld pages copied, %lld frames reused\n", cow_copied, cow_reused);
+	anon_print_stats ();
 }
 
 /* Get the type of the page. This function is useful if you want to know the
@@ -50,7 +228,25 @@ page_get_type (struct page *page) {
 /* Helpers */
 static struct frame *vm_get_victim (void);
 static bool vm_do_claim_page (struct page *page);
+static bool vm_claim_page_with (struct page *page, struct frame *frame);
+static bool vm_claim (struct page *page);
+static bool vm_claim_text_page (struct page *page, bool speculative);
+static bool vm_claim_file_page (struct page *page, bool speculative);
+static bool vm_fault_page (void *va, bool write, bool not_present);
+static void text_forget (struct frame *frame);
+static void ksm_forget (struct frame *frame);
+static bool fault_around_eligible (struct page *page);
+static void vm_fault_around_pages (struct page *faulted);
+static bool vm_try_huge (struct supplemental_page_table *spt,
+		struct vm_region *region, void *va, bool write);
+static void vm_unmap_page (struct page *page);
 static struct frame *vm_evict_frame (void);
+static void vm_initialize_page (struct page *page, void *kva);
+static bool vm_map_zero_page (struct page *page);
+static void free_frame (struct frame *frame);
+static void lru_push (struct frame *frame);
+static void lru_remove (struct frame *frame);
+void clear_frame(struct frame* frame);
 
 /* Create the pending page object with initializer. If you want to create a
  * page, do not create it directly and make it through this function or
@@ -71,7 +267,7 @@ vm_alloc_page_with_initializer (enum vm_type type, void *upage, bool writable,
 		/* TODO: Create the page, fetch the initialier according to the VM type,
 		 * TODO: and then create "uninit" page struct by calling uninit_new. You
 		 * TODO: should modify the field after calling the uninit_new. */
-		page = malloc(sizeof(struct page));
+		page = kmem_cache_alloc(page_slab);
 
 		// TODO: malloc fail 시 처리 이게 맞나??
 		if (page == NULL) {
@@ -81,8 +277,12 @@ vm_alloc_page_with_initializer (enum vm_type type, void *upage, bool writable,
 		initializer = (VM_TYPE(type) == VM_ANON) ? anon_initializer : file_backed_initializer;
 		uninit_new (page, upage, init, type, aux, initializer);
 		page->writable = writable;
+		page->cow_writable = true;
 		page->uninit.copy = (VM_TYPE(type) == VM_ANON) ? copy_lazy_parameter : copy_mmap_parameter;
 		page->swapped_out = false;
+		page->fork_pending = false;
+		page->advice = VM_ADV_NORMAL;
+		page->mlocked = false;
 		page->owner = thread_current();
 
 		/* TODO: Insert the page into the spt. */
@@ -97,18 +297,97 @@ err:
 	return false;
 }
 
+/* Index of VA in a node of LEVEL, 0 being the leaves. */
+static size_t
+spt_index (uint64_t va, int level) {
+	return (va >> (PTXSHIFT + SPT_BITS * level)) & (SPT_SLOTS - 1);
+}
+
+/* Constructor of spt_node_slab.  Nodes are only freed once they are
+ * empty, so they stay constructed. */
+static void
+spt_node_init (void *node) {
+	memset(node, 0, SPT_NODE_SIZE);
+}
+
+/* Returns the leaf slot of VA in SPT.  Missing nodes are allocated if
+ * CREATE is true; otherwise, or if that fails, returns NULL.
+ * Must hold spt->lock. */
+static struct page **
+spt_walk (struct supplemental_page_table *spt, uint64_t va, bool create) {
+	void **node, **slot;
+	int level;
+
+	if (va >> (PTXSHIFT + SPT_BITS * SPT_LEVELS) != 0)
+		return NULL;
+	if (spt->root == NULL
+			&& (!create || (spt->root = kmem_cache_alloc(spt_node_slab)) == NULL))
+		return NULL;
+	node = spt->root;
+	for (level = SPT_LEVELS - 1; level > 0; level--) {
+		slot = &node[spt_index(va, level)];
+		if (*slot == NULL && (!create || (*slot = kmem_cache_alloc(spt_node_slab)) == NULL))
+			return NULL;
+		node = *slot;
+	}
+	return (struct page **) &node[spt_index(va, 0)];
+}
+
+static bool
+spt_node_empty (void **node) {
+	size_t i;
+
+	for (i = 0; i < SPT_SLOTS; i++)
+		if (node[i] != NULL)
+			return false;
+	return true;
+}
+
+/* Returns the page of lowest address in [START, END) under NODE, a
+ * node of LEVEL whose first slot starts at BASE, or NULL. */
+static struct page *
+spt_next_in (void **node, int level, uint64_t base, uint64_t start, uint64_t end) {
+	uint64_t span = 1ULL << (PTXSHIFT + SPT_BITS * level);
+	size_t i = start > base ? (start - base) / span : 0;
+	struct page *page;
+
+	for (; i < SPT_SLOTS && base + i * span < end; i++) {
+		if (node[i] == NULL)
+			continue;
+		if (level == 0)
+			return node[i];
+		page = spt_next_in(node[i], level - 1, base + i * span, start, end);
+		if (page != NULL)
+			return page;
+	}
+	return NULL;
+}
+
 /* Find VA from spt and return page. On error, return NULL. */
 struct page *
 spt_find_page (struct supplemental_page_table *spt UNUSED, void *va UNUSED) {
 	struct page *page = NULL;
 	/* TODO: Fill this function. */
-	struct page p;
-  struct hash_elem *h_el;
+	struct page **slot;
+
+	lock_acquire(&spt->lock);
+	slot = spt_walk(spt, (uint64_t) va, false);
+	if (slot != NULL)
+		page = *slot;
+	lock_release(&spt->lock);
+	return page;
+}
 
-	p.va = va;
-	h_el = hash_find(&spt->hash, &p.spt_hash_elem);
-	if (h_el != NULL)
-		page = hash_entry(h_el, struct page, spt_hash_elem);
+/* Returns the page of lowest address in [START, END) of SPT, or NULL.
+ * Untouched parts of the range are skipped a whole node at a time. */
+struct page *
+spt_find_next (struct supplemental_page_table *spt, void *start, void *end) {
+	struct page *page = NULL;
+
+	lock_acquire(&spt->lock);
+	if (spt->root != NULL)
+		page = spt_next_in(spt->root, SPT_LEVELS - 1, 0, (uint64_t) start, (uint64_t) end);
+	lock_release(&spt->lock);
 	return page;
 }
 
@@ -117,88 +396,647 @@ bool
 spt_insert_page (struct supplemental_page_table *spt UNUSED,
 		struct page *page UNUSED) {
 	/* TODO: Fill this function. */
-	struct hash_elem* result;
-
-	lock_acquire(&hash_lock);
-	result = hash_insert(&spt->hash, &page->spt_hash_elem);
-	lock_release(&hash_lock);
+	struct page **slot;
+	bool succ = false;
 
-	if (result == NULL)
-		return true;
-	
-	return false;
+	lock_acquire(&spt->lock);
+	slot = spt_walk(spt, (uint64_t) page->va, true);
+	if (slot != NULL && *slot == NULL) {
+		*slot = page;
+		succ = true;
+	}
+	lock_release(&spt->lock);
+	return succ;
 }
 
+/* Removes PAGE, which the caller holds busy, from SPT and frees it. */
 void
 spt_remove_page (struct supplemental_page_table *spt, struct page *page) {
+	void **path[SPT_LEVELS];
+	void **node;
+	uint64_t va = (uint64_t) page->va;
+	int level;
+
+	lock_acquire(&spt->lock);
+	node = spt->root;
+	for (level = SPT_LEVELS - 1; level >= 0 && node != NULL; level--) {
+		path[level] = node;
+		node = node[spt_index(va, level)];
+	}
+	if (node == (void **) page) {
+		path[0][spt_index(va, 0)] = NULL;
+		/* Free the nodes left empty, bottom up; the root stays. */
+		for (level = 0; level < SPT_LEVELS - 1 && spt_node_empty(path[level]); level++) {
+			kmem_cache_free(spt_node_slab, path[level]);
+			path[level + 1][spt_index(va, level + 1)] = NULL;
+		}
+	}
+	lock_release(&spt->lock);
 	vm_dealloc_page (page);
+}
+
+/* Returns true if SPT has no page in [START, END). */
+bool
+spt_range_empty (struct supplemental_page_table *spt, void *start, void *end) {
+	return spt_find_next(spt, start, end) == NULL;
+}
+
+/* Returns true if VA may be written by the owner of SPT, whether its
+ * page has been created yet or not. */
+bool
+spt_is_writable (struct supplemental_page_table *spt, void *va) {
+	struct page *page = spt_find_page(spt, va);
+	struct vm_region *region;
+
+	if (page != NULL)
+		return page->writable;
+	region = region_find(&spt->regions, va);
+	return region != NULL && region->writable;
+}
+
+/* Waits until no one else is faulting in or evicting PAGE, then marks
+ * it busy.  While a page is busy, only its holder may change its
+ * frame, its swap state or its page table entry. */
+void
+vm_page_busy (struct page *page) {
+	lock_acquire(&frame_lock);
+	while (page->busy)
+		cond_wait(&page_idle, &frame_lock);
+	page->busy = true;
+	lock_release(&frame_lock);
+}
+
+/* Marks PAGE busy if it is not.  Returns false if it already was. */
+bool
+vm_page_try_busy (struct page *page) {
+	bool succ;
+
+	lock_acquire(&frame_lock);
+	succ = !page->busy;
+	page->busy = true;
+	lock_release(&frame_lock);
+	return succ;
+}
+
+/* Clears the busy mark set by vm_page_busy and wakes its waiters. */
+void
+vm_page_unbusy (struct page *page) {
+	lock_acquire(&frame_lock);
+	ASSERT (page->busy);
+	page->busy = false;
+	cond_broadcast(&page_idle, &frame_lock);
+	lock_release(&frame_lock);
+}
+
+/* Returns true if none of the pages mapping FRAME are busy.
+ * Must hold frame_lock. */
+static bool
+frame_is_idle (struct frame *frame) {
+	struct list_elem *el;
+
+	if (frame->pin_cnt > 0)
+		return false;
+	for (el = list_begin(&frame->referers); el != list_end(&frame->referers); el = list_next(el))
+		if (list_entry(el, struct page, referer_elem)->busy)
+			return false;
 	return true;
 }
 
-/* Get the struct frame, that will be evicted. */
+/* Get the struct frame, that will be evicted, or NULL if every frame
+ * is in use by a fault.  The referers of the victim are marked busy
+ * and unmapped.  Must hold frame_lock. */
 static struct frame *
 vm_get_victim (void) {
 	struct frame *victim = NULL;
+	struct list_elem *el;
+	size_t tries = list_size(&frames_list);
+
 	 /* TODO: The policy for eviction is up to you. */
-	return list_entry(list_pop_back(&frames_list), struct frame, elem);
+	while (tries-- > 0) {
+		victim = list_entry(list_back(&frames_list), struct frame, elem);
+		lru_remove(victim);
+		if (frame_is_idle(victim))
+			break;
+		lru_push(victim);
+		victim = NULL;
+	}
+	if (victim == NULL)
+		return NULL;
+
+	/* Nobody may start sharing the victim from now on. */
+	text_forget(victim);
+	ksm_forget(victim);
+	for (el = list_begin(&victim->referers); el != list_end(&victim->referers); el = list_next(el)) {
+		struct page *page = list_entry(el, struct page, referer_elem);
+
+		page->busy = true;
+		/* The page cache does not map its pages. */
+		if (page->owner == NULL)
+			continue;
+		if (pml4_is_dirty(page->owner->pml4, page->va))
+			victim->flags |= FRAME_DIRTY;
+		vm_unmap_page(page);
+	}
+	return victim;
 }
 
-void
-init_frame_struct(struct frame* frame, void *kva) {
-	frame->kva = kva;
-	frame->original_kva = kva;
+/* Resets FRAME, which was just taken from the user pool. */
+static void
+init_frame_struct(struct frame* frame) {
+	ASSERT (frame->refcnt == 0);
 	frame->page = NULL;
+	frame->flags = 0;
+	frame->pin_cnt = 0;
+	frame->text_inode = NULL;
 	list_init(&frame->referers);
+}
+
+/* Adds PAGE to the referers of FRAME.  Must hold frame_lock. */
+static void
+frame_ref (struct frame *frame, struct page *page) {
+	list_push_front(&frame->referers, &page->referer_elem);
+	frame->refcnt++;
+	/* An mlocked page pins whichever frame it is on. */
+	if (page->mlocked)
+		frame->pin_cnt++;
+}
+
+/* Removes PAGE from the referers of its frame and returns true if it
+ * was the last one.  Must hold frame_lock. */
+static bool
+frame_unref (struct page *page) {
+	list_remove(&page->referer_elem);
+	if (page->mlocked)
+		page->frame->pin_cnt--;
+	return --page->frame->refcnt == 0;
+}
+
+/* Puts FRAME at the head of the LRU list.  Must hold frame_lock. */
+static void
+lru_push (struct frame *frame) {
 	list_push_front(&frames_list, &frame->elem);
+	frame->flags |= FRAME_LRU;
 }
 
-/* Evict one page and return the corresponding frame.
- * Return NULL on error.*/
-static struct frame *
-vm_evict_frame (void) {
-	struct frame *victim UNUSED = vm_get_victim ();
+/* Takes FRAME off the LRU list.  Must hold frame_lock. */
+static void
+lru_remove (struct frame *frame) {
+	if (frame->flags & FRAME_LRU)
+		list_remove(&frame->elem);
+	frame->flags &= ~FRAME_LRU;
+}
+
+/* Writes out every page that refers to VICTIM.  The anonymous ones
+ * go to CLUSTER, which is flushed to swap whenever it fills up;
+ * file-backed pages are written back on their own. */
+static void
+evict_referers (struct frame *victim, struct page **cluster, size_t *cluster_cnt) {
 	struct page* page_to_evict;
 	struct list_elem* el;
-	
-	/* TODO: swap out the victim and return the evicted frame. */
-	el = list_front(&victim->referers);
-	while (el != list_end(&victim->referers)) {
+
+	for (el = list_begin(&victim->referers); el != list_end(&victim->referers); el = list_next(el)) {
 		page_to_evict = list_entry(el, struct page, referer_elem);
-		swap_out(page_to_evict);
-		page_to_evict->swapped_out = true;
-		page_to_evict->frame = NULL;
-		pml4_clear_page(thread_current()->pml4, page_to_evict->va);
-		el = el->next;
-		list_remove(&page_to_evict->referer_elem);
+		/* Text is read back from the executable. */
+		if (VM_TYPE(page_to_evict->operations->type) == VM_ANON
+				&& page_to_evict->anon.text_file != NULL) {
+			page_to_evict->swapped_out = true;
+			continue;
+		}
+		if (VM_TYPE(page_to_evict->operations->type) != VM_ANON) {
+			/* A clean mapping is the same as its file. */
+			if (victim->flags & FRAME_DIRTY)
+				swap_out(page_to_evict);
+			page_to_evict->swapped_out = true;
+			continue;
+		}
+		cluster[(*cluster_cnt)++] = page_to_evict;
+		if (*cluster_cnt == SWAP_CLUSTER_MAX) {
+			anon_swap_out_cluster(cluster, *cluster_cnt);
+			*cluster_cnt = 0;
+		}
 	}
-	init_frame_struct(victim, victim->original_kva);
+}
 
-	return victim;
+/* Detaches every referer of VICTIM, which must already be swapped
+ * out, and clears their busy mark.  Must hold frame_lock. */
+static void
+detach_referers (struct frame *victim) {
+	struct page* page;
+
+	while (!list_empty(&victim->referers)) {
+		page = list_entry(list_front(&victim->referers), struct page, referer_elem);
+		frame_unref(page);
+		page->frame = NULL;
+		page->busy = false;
+		/* The page cache let go of PAGE while it was being evicted. */
+		if (page->operations->type == VM_PAGE_CACHE && page->page_cache.inode == NULL)
+			kmem_cache_free(page_slab, page);
+	}
+}
+
+/* Evict a batch of up to SWAP_CLUSTER_MAX frames and return one of
+ * them; the others go back to the user pool so that the next faults
+ * find a free page without evicting again.  The anonymous pages of
+ * the whole batch are written to contiguous swap slots with as few
+ * disk requests as possible.  frame_lock is only held to pick the
+ * victims and to detach them, not during the writes; faults on the
+ * victims wait for the pages to stop being busy.
+ * Return NULL if no frame can be evicted right now.*/
+static struct frame *
+vm_evict_frame (void) {
+	struct frame *victims[SWAP_CLUSTER_MAX];
+	struct page *cluster[SWAP_CLUSTER_MAX];
+	size_t victim_cnt = 0, cluster_cnt = 0, i;
+
+	/* TODO: swap out the victim and return the evicted frame. */
+	lock_acquire(&frame_lock);
+	while (victim_cnt < SWAP_CLUSTER_MAX
+			&& (victims[victim_cnt] = vm_get_victim ()) != NULL)
+		victim_cnt++;
+	lock_release(&frame_lock);
+	if (victim_cnt == 0)
+		return NULL;
+
+	for (i = 0; i < victim_cnt; i++)
+		evict_referers(victims[i], cluster, &cluster_cnt);
+	if (cluster_cnt > 0)
+		anon_swap_out_cluster(cluster, cluster_cnt);
+
+	lock_acquire(&frame_lock);
+	for (i = 0; i < victim_cnt; i++)
+		detach_referers(victims[i]);
+	cond_broadcast(&page_idle, &frame_lock);
+	lock_release(&frame_lock);
+
+	for (i = 1; i < victim_cnt; i++)
+		free_frame(victims[i]);
+	init_frame_struct(victims[0]);
+	memset(victims[0]->kva, 0, PGSIZE);
+
+	return victims[0];
 }
 
 /* palloc() and get frame. If there is no available page, evict the page
  * and return it. This always return valid address. That is, if the user pool
  * memory is full, this function evicts the frame to get the available memory
- * space.*/
+ * space.  The frame is not on frames_list until it is mapped. */
 static struct frame *
 vm_get_frame (void) {
 	struct frame *frame = NULL;
 	/* TODO: Fill this function. */
-	void* newpage = palloc_get_page(PAL_USER | PAL_ZERO);
+	void* newpage;
 
-	if (newpage == NULL) {
-		if (list_empty(&frames_list))
-			PANIC("disk problem: nothing allocated but no frame's possible");
-		return vm_evict_frame();
+	while ((newpage = palloc_get_page(PAL_USER | PAL_ZERO)) == NULL) {
+		if (frame_cnt == 0)
+			PANIC("no user frames");
+		direct_reclaims++;
+		if ((frame = vm_evict_frame()) != NULL)
+			return frame;
+		/* Every frame is being faulted in, evicted or freed, so none is
+		 * on frames_list yet; let them finish. */
+		thread_yield();
 	}
-	frame = malloc(sizeof(struct frame));
-	init_frame_struct(frame, newpage);
+	if (palloc_free_cnt(PAL_USER) < vm_low_watermark)
+		sema_up(&kswapd_sema);
+	frame = vm_frame_of(newpage);
+	init_frame_struct(frame);
+	return frame;
+}
+
+/* Like vm_get_frame, but never evicts: returns NULL when the user pool
+ * is exhausted.  The frame is not zeroed.  Used for speculative work
+ * such as swap readahead. */
+struct frame *
+vm_try_get_frame (void) {
+	struct frame *frame;
+	void* newpage = palloc_get_page(PAL_USER);
 
-	ASSERT (frame != NULL);
-	ASSERT (frame->page == NULL);
+	if (newpage == NULL)
+		return NULL;
+	frame = vm_frame_of(newpage);
+	init_frame_struct(frame);
 	return frame;
 }
 
+/* Links PAGE, which the caller holds busy, with the new FRAME, maps it
+ * in the page table of its owner and makes FRAME evictable.  A page
+ * that still shares its contents copy-on-write is mapped read-only. */
+bool
+vm_map_frame (struct page *page, struct frame *frame) {
+	bool succ;
+
+	lock_acquire(&frame_lock);
+	frame->page = page;
+	page->frame = frame;
+	frame_ref(frame, page);
+	lru_push(frame);
+	succ = pml4_set_page(page->owner->pml4, page->va, frame->kva,
+			page->writable && page->cow_writable);
+	lock_release(&frame_lock);
+	return succ;
+}
+
+/* Reclaim thread.  Woken by vm_get_frame when the user pool drops
+ * below vm_low_watermark, it evicts batches of frames until
+ * vm_high_watermark pages are free, so that faults seldom have to
+ * evict by themselves. */
+static void
+kswapd (void *aux UNUSED) {
+	struct frame *frame;
+	size_t before;
+
+	for (;;) {
+		sema_down(&kswapd_sema);
+		while (sema_try_down(&kswapd_sema))
+			continue;
+
+		while ((before = palloc_free_cnt(PAL_USER)) < vm_high_watermark
+				&& (frame = vm_evict_frame()) != NULL) {
+			free_frame(frame);
+			kswapd_reclaimed += palloc_free_cnt(PAL_USER) - before;
+		}
+	}
+}
+
+/* Returns true if PAGE may be written back: a file page in memory
+ * whose mapping is still there. */
+static bool
+writeback_eligible (struct page *page) {
+	return VM_TYPE(page->operations->type) == VM_FILE
+			&& page->frame != NULL && page->file.file != NULL;
+}
+
+/* Returns true if NEXT continues PREV in the same file. */
+static bool
+writeback_continues (struct page *prev, struct page *next) {
+	return file_get_inode(prev->file.file) == file_get_inode(next->file.file)
+			&& prev->file.data_bytes == PGSIZE
+			&& next->file.offset == prev->file.offset + PGSIZE;
+}
+
+/* Returns true if PAGE, an eligible page the caller holds busy, was
+ * written since its last writeback, and marks it clean.  Writes from
+ * now on dirty it again. */
+static bool
+page_test_and_clean (struct page *page) {
+	bool dirty;
+
+	lock_acquire(&frame_lock);
+	dirty = (page->frame->flags & FRAME_DIRTY)
+			|| pml4_is_dirty(page->owner->pml4, page->va);
+	if (dirty) {
+		page->frame->flags &= ~FRAME_DIRTY;
+		pml4_set_dirty(page->owner->pml4, page->va, false);
+	}
+	lock_release(&frame_lock);
+	return dirty;
+}
+
+/* Writes back the CNT busy pages of RUN, which follow each other in
+ * one file, and unbusies them.  There is no vectored file write, so
+ * the run is written in file order under one hold of filesys_lock. */
+static void
+writeback_run (struct page **run, size_t cnt) {
+	size_t i;
+
+	if (cnt == 0)
+		return;
+	lock_acquire(&filesys_lock);
+	for (i = 0; i < cnt; i++)
+		file_write_at(run[i]->file.file, run[i]->frame->kva,
+				run[i]->file.data_bytes, run[i]->file.offset);
+	lock_release(&filesys_lock);
+	for (i = 0; i < cnt; i++)
+		vm_page_unbusy(run[i]);
+	writeback_pages += cnt;
+	writeback_runs++;
+}
+
+/* Writes back the dirty pages of file mappings of the current process
+ * in [START, END). */
+void
+vm_msync (void *start, void *end) {
+	struct supplemental_page_table *spt = &thread_current()->spt;
+	struct page *run[WRITEBACK_RUN_MAX];
+	struct page *page;
+	size_t cnt = 0;
+	void *va;
+
+	for (va = start; (page = spt_find_next(spt, va, end)) != NULL; ) {
+		va = page->va + PGSIZE;
+		if (VM_TYPE(page->operations->type) != VM_FILE)
+			continue;
+		vm_page_busy(page);
+		if (!writeback_eligible(page) || !page_test_and_clean(page)) {
+			vm_page_unbusy(page);
+			continue;
+		}
+		if (cnt == WRITEBACK_RUN_MAX
+				|| (cnt > 0 && !writeback_continues(run[cnt - 1], page))) {
+			writeback_run(run, cnt);
+			cnt = 0;
+		}
+		run[cnt++] = page;
+	}
+	writeback_run(run, cnt);
+}
+
+/* Adds to RUN, which holds CNT busy pages of one process, the dirty
+ * pages that follow its last one both in memory and in the file, as
+ * long as nobody else is using them.  Returns the new count. */
+static size_t
+writeback_extend (struct page **run, size_t cnt) {
+	struct supplemental_page_table *spt = &run[0]->owner->spt;
+	struct page *next, **slot;
+
+	while (cnt < WRITEBACK_RUN_MAX) {
+		next = NULL;
+		lock_acquire(&spt->lock);
+		slot = spt_walk(spt, (uint64_t) run[cnt - 1]->va + PGSIZE, false);
+		if (slot != NULL && *slot != NULL && vm_page_try_busy(*slot))
+			next = *slot;
+		lock_release(&spt->lock);
+		if (next == NULL)
+			break;
+		if (!writeback_eligible(next) || !writeback_continues(run[cnt - 1], next)
+				|| !page_test_and_clean(next)) {
+			vm_page_unbusy(next);
+			break;
+		}
+		run[cnt++] = next;
+	}
+	return cnt;
+}
+
+/* Writeback thread.  Every vm_writeback_secs seconds it writes back
+ * the dirty pages of file mappings of every process, so that a crash
+ * loses at most that much.  The frame table is scanned for dirty
+ * pages, and each one found starts a run with the pages after it. */
+static void
+flushd (void *aux UNUSED) {
+	struct page *run[WRITEBACK_RUN_MAX];
+	struct page *page;
+	struct list_elem *el;
+	size_t i;
+
+	for (;;) {
+		timer_sleep(vm_writeback_secs * TIMER_FREQ);
+		for (i = 0; i < frame_cnt; i++) {
+			struct frame *frame = &frame_table[i];
+
+			/* A frame of the page cache may be mapped by several. */
+			page = NULL;
+			lock_acquire(&frame_lock);
+			for (el = list_begin(&frame->referers); el != list_end(&frame->referers);
+					el = list_next(el)) {
+				page = list_entry(el, struct page, referer_elem);
+				if (!page->busy && writeback_eligible(page)) {
+					page->busy = true;
+					break;
+				}
+				page = NULL;
+			}
+			lock_release(&frame_lock);
+			if (page == NULL)
+				continue;
+			if (!page_test_and_clean(page)) {
+				vm_page_unbusy(page);
+				continue;
+			}
+			run[0] = page;
+			writeback_run(run, writeback_extend(run, 1));
+		}
+	}
+}
+
+static uint64_t
+ksm_hash (const struct hash_elem *e, void *aux UNUSED) {
+	return hash_entry(e, struct frame, ksm_elem)->ksm_sum;
+}
+
+static bool
+ksm_less (const struct hash_elem *a, const struct hash_elem *b, void *aux UNUSED) {
+	return hash_entry(a, struct frame, ksm_elem)->ksm_sum
+			< hash_entry(b, struct frame, ksm_elem)->ksm_sum;
+}
+
+/* Takes FRAME out of the merge table, if it is there.
+ * Must hold frame_lock. */
+static void
+ksm_forget (struct frame *frame) {
+	if (!(frame->flags & FRAME_KSM))
+		return;
+	hash_delete(&ksm_table, &frame->ksm_elem);
+	frame->flags &= ~FRAME_KSM;
+}
+
+/* Returns true if FRAME may be merged: an evictable frame of plain
+ * anonymous pages that is not in the merge table yet, and that
+ * nobody is working on.  Must hold frame_lock. */
+static bool
+ksm_eligible (struct frame *frame) {
+	struct list_elem *el;
+
+	if (!(frame->flags & FRAME_LRU) || (frame->flags & FRAME_KSM)
+			|| frame->pin_cnt > 0 || frame->text_inode != NULL
+			|| list_empty(&frame->referers))
+		return false;
+	for (el = list_begin(&frame->referers); el != list_end(&frame->referers); el = list_next(el)) {
+		struct page *page = list_entry(el, struct page, referer_elem);
+
+		if (page->busy || page->fork_pending
+				|| VM_TYPE(page->operations->type) != VM_ANON
+				|| page->anon.text_file != NULL)
+			return false;
+	}
+	return true;
+}
+
+/* Looks at FRAME for merging.  Only a frame whose checksum is the
+ * same as at the previous pass is merged, so that pages being written
+ * are left alone.  Its pages are write-protected first, which fixes
+ * the contents: a write now goes through vm_handle_wp.  The pages are
+ * then moved onto the frame of the table with the same contents, if
+ * there is one, and FRAME is freed; otherwise FRAME enters the table
+ * for the next ones. */
+static void
+ksm_scan_frame (struct frame *frame) {
+	struct frame key, *stable = NULL;
+	struct list_elem *el;
+	struct page *page;
+	struct hash_elem *e;
+	uint64_t sum = hash_bytes(frame->kva, PGSIZE);
+	unsigned cnt, i;
+
+	lock_acquire(&frame_lock);
+	if (!ksm_eligible(frame) || sum != frame->ksm_sum) {
+		frame->ksm_sum = sum;
+		lock_release(&frame_lock);
+		return;
+	}
+	for (el = list_begin(&frame->referers); el != list_end(&frame->referers); el = list_next(el)) {
+		page = list_entry(el, struct page, referer_elem);
+		page->busy = true;
+		page->cow_writable = false;
+		pml4_set_page(page->owner->pml4, page->va, frame->kva, false);
+	}
+	cnt = frame->refcnt;
+	lock_release(&frame_lock);
+
+	/* The pages may have been written before they were protected. */
+	key.ksm_sum = frame->ksm_sum = hash_bytes(frame->kva, PGSIZE);
+
+	lock_acquire(&frame_lock);
+	e = hash_find(&ksm_table, &key.ksm_elem);
+	if (e != NULL)
+		stable = hash_entry(e, struct frame, ksm_elem);
+	/* A fork may have added pages in the meantime, at the front. */
+	if (stable != NULL && frame->refcnt == cnt
+			&& !memcmp(stable->kva, frame->kva, PGSIZE)) {
+		while (!list_empty(&frame->referers)) {
+			page = list_entry(list_front(&frame->referers), struct page, referer_elem);
+			frame_unref(page);
+			frame_ref(stable, page);
+			page->frame = stable;
+			page->busy = false;
+			pml4_set_page(page->owner->pml4, page->va, stable->kva, false);
+			ksm_merged++;
+		}
+		clear_frame(frame);
+	} else {
+		if (stable == NULL) {
+			hash_insert(&ksm_table, &frame->ksm_elem);
+			frame->flags |= FRAME_KSM;
+		}
+		for (el = list_rbegin(&frame->referers), i = 0; i < cnt; el = list_prev(el), i++)
+			list_entry(el, struct page, referer_elem)->busy = false;
+	}
+	cond_broadcast(&page_idle, &frame_lock);
+	lock_release(&frame_lock);
+}
+
+/* Same-page merging thread.  Every KSM_INTERVAL it looks at the next
+ * vm_ksm_pages frames of the frame table, going round it, so that
+ * processes that hold the same data, such as the children of one
+ * parent after they wrote it, share it again.  It runs at the lowest
+ * priority, in the time nothing else wants. */
+static void
+ksmd (void *aux UNUSED) {
+	size_t next = 0, i;
+
+	for (;;) {
+		timer_sleep(KSM_INTERVAL);
+		for (i = 0; i < vm_ksm_pages; i++) {
+			ksm_scan_frame(&frame_table[next]);
+			ksm_scanned++;
+			if (++next == frame_cnt) {
+				next = 0;
+				ksm_passes++;
+			}
+		}
+	}
+}
+
 void
 after_stack_set(struct page *page, void *aux) {
 	thread_current()->stack_page_count++;
@@ -213,7 +1051,7 @@ vm_stack_growth (void *addr UNUSED) {
 
 	while (currPtr >= stack_end) {
 		if (spt_find_page(&thread_current()->spt, currPtr) == NULL) {
-			if (!vm_alloc_page_with_initializer(VM_ANON, currPtr, true, after_stack_set, NULL)) {
+			if (!vm_alloc_page_with_initializer(VM_ANON | VM_ZERO_FILL, currPtr, true, after_stack_set, NULL)) {
 				success = false;
 				break;
 			}
@@ -224,37 +1062,64 @@ vm_stack_growth (void *addr UNUSED) {
 		thread_current()->tf.rsp = addr;
 }
 
+/* Returns FRAME, which is on no list, to the user pool. */
+static void
+free_frame (struct frame *frame) {
+	frame->flags = 0;
+	palloc_free_page(frame->kva);
+}
+
+/* Frees FRAME once it has no referers left.  Must hold frame_lock. */
 void
 clear_frame(struct frame* frame) {
-	list_remove(&frame->elem);
-	palloc_free_page(frame->kva);
-	free(frame);
+	if (frame == zero_frame)
+		return;
+	text_forget(frame);
+	ksm_forget(frame);
+	lru_remove(frame);
+	free_frame(frame);
 }
 
-/* Handle the fault on write_protected page */
+/* Handle the fault on write_protected page.  PAGE is held busy, which
+ * also keeps the shared frame from being evicted under us.  If PAGE is
+ * the last one left on its frame, the frame becomes its own and is
+ * just mapped writable; otherwise PAGE gets a copy. */
 static bool
 vm_handle_wp (struct page *page UNUSED) {
 	struct frame* original_frame = page->frame;
-	struct frame* new_frame = vm_get_frame();
+	struct frame* new_frame;
 	bool succ;
 
+	lock_acquire(&frame_lock);
+	if (original_frame->refcnt == 1 && original_frame != zero_frame
+			&& original_frame->text_inode == NULL) {
+		/* Its contents are about to change. */
+		ksm_forget(original_frame);
+		original_frame->page = page;
+		page->cow_writable = true;
+		succ = pml4_set_page(page->owner->pml4, page->va, original_frame->kva, page->writable);
+		lock_release(&frame_lock);
+		cow_reused++;
+		return succ;
+	}
+	lock_release(&frame_lock);
+
+	cow_copied++;
+	new_frame = vm_get_frame();
+	memcpy(new_frame->kva, original_frame->kva, PGSIZE);
+
+	lock_acquire(&frame_lock);
+	new_frame->flags |= original_frame->flags & FRAME_DIRTY;
+	if (frame_unref(page))
+		clear_frame(original_frame);
 	new_frame->page = page;
 	page->frame = new_frame;
 	page->cow_writable = true;
-	lock_acquire(&cow_lock);
-	pml4_clear_page(thread_current()->pml4, page->va);
-	succ = pml4_set_page(thread_current()->pml4, page->va, new_frame->kva, page->writable);
-	memcpy(new_frame->kva, original_frame->kva, PGSIZE);
-	lock_release(&cow_lock);
-	if (VM_TYPE(page->operations->type) == VM_FILE) {
-		lock_acquire(&filesys_lock);
-		page->file.file = file_reopen(page->file.file);
-		lock_release(&filesys_lock);
-	}
-	list_remove(&page->referer_elem);
-	if (list_empty(&original_frame->referers))
-		clear_frame(original_frame);
-	list_push_front(&new_frame->referers, &page->referer_elem);
+	frame_ref(new_frame, page);
+	lru_push(new_frame);
+	vm_unmap_page(page);
+	succ = pml4_set_page(page->owner->pml4, page->va, new_frame->kva, page->writable);
+	lock_release(&frame_lock);
 
 	page->swapped_out = false;
 	return succ;
@@ -265,55 +1130,82 @@ bool
 vm_try_handle_fault (struct intr_frame *f UNUSED, void *addr UNUSED,
 		bool user UNUSED, bool write UNUSED, bool not_present UNUSED) {
 	struct thread* curr = thread_current();
-	struct supplemental_page_table *spt UNUSED = &curr->spt;
-	struct page *page = NULL;
 	/* TODO: Validate the fault */
 	/* TODO: Your code goes here */
 	int MAX_STACK_COUNT = 256;
 	int MAX_STACK_ADDR = USER_STACK - 1 << 20;	// limit stack size to 1mb
-	bool succ;
 
 	// printf("fault handler at %p by %d\n", addr, user);
-	lock_acquire(&handle_fault_lock);
-	if (user && is_kernel_vaddr(addr)) {
-		succ = false;
-		goto done;
-	}
+	if (user && is_kernel_vaddr(addr))
+		return false;
 	if ((user && f->rsp - 8 <= (uintptr_t)addr) || (!user && ptov(addr) >= MAX_STACK_ADDR)) {
-		if (curr->stack_page_count >= MAX_STACK_COUNT) {
-			lock_release(&handle_fault_lock);
+		if (curr->stack_page_count >= MAX_STACK_COUNT)
 			exit(-1);
-		}
 		vm_stack_growth(user ? addr : ptov(addr));
 	}
-	page = spt_find_page (&thread_current()->spt, pg_round_down(addr));
+	return vm_fault_page(pg_round_down(addr), write, not_present);
+}
+
+/* Serves a fault on the page at VA of the current process. */
+static bool
+vm_fault_page (void *va, bool write, bool not_present) {
+	struct thread *curr = thread_current();
+	struct supplemental_page_table *spt = &curr->spt;
+	struct page *page;
+	struct vm_region *region;
+	bool succ, around;
+
+	page = spt_find_page (spt, va);
 	if (page == NULL) {
-		succ = false;
-		goto done;
-	}
-	if ((!not_present && write)) {
-		if (!not_present && !page->writable) {
-			succ=false;
-			goto done;
-		}
-		if (!not_present && !page->cow_writable) {
-			succ = vm_handle_wp(page);
-			goto done;
-		}
+		/* The first touch of a page of a region creates it. */
+		region = region_find(&spt->regions, va);
+		if (region == NULL || (write && !region->writable))
+			return false;
+		if (vm_try_huge(spt, region, va, write))
+			return true;
+		page = region_fault_in(region, va);
+		if (page == NULL)
+			return false;
 	}
-	if (page_get_type(page) == VM_FILE && page->file.file == NULL) {
-		succ = false;
-		goto done;
-	}
-	succ = vm_do_claim_page (page);
-	done:
-		lock_release(&handle_fault_lock);
-		if (!succ)
-			return succ;
-		if (!write)
-			pml4_set_dirty(curr->pml4, page->va, false);
+	if (write && !page->writable)
+		return false;
+	if (page_get_type(page) == VM_FILE && page->file.file == NULL)
+		return false;
+	if (page->fork_pending)
+		fork_push(page);
 
+	/* Someone else may have brought the page in, or taken it out,
+	 * while we waited, so look at it again once it is ours. */
+	vm_page_busy(page);
+	around = fault_around_eligible(page);
+	if (page->frame == NULL) {
+		if (!write && page->operations->type == VM_UNINIT
+				&& (page->uninit.type & VM_ZERO_FILL))
+			succ = vm_map_zero_page (page);
+		else
+			succ = vm_claim (page);
+	} else if (write && !page->cow_writable && !not_present)
+		succ = vm_handle_wp(page);
+	else if (not_present && pml4_get_page(curr->pml4, page->va) == NULL) {
+		/* Its 2 MB mapping was torn down by vm_unmap_page. */
+		lock_acquire(&frame_lock);
+		succ = pml4_set_page(curr->pml4, page->va, page->frame->kva,
+				page->writable && page->cow_writable);
+		lock_release(&frame_lock);
+	} else
+		succ = true;
+	vm_page_unbusy(page);
+	if (succ && not_present && around)
+		vm_fault_around_pages(page);
+	if (succ && not_present && page->advice == VM_ADV_SEQUENTIAL)
+		vm_populate(page->va + PGSIZE, page->va + (vm_fault_around + 1) * PGSIZE, true);
+
+	if (!succ)
 		return succ;
+	if (!write)
+		pml4_set_dirty(curr->pml4, page->va, false);
+
+	return succ;
 }
 
 /* Free the page.
@@ -321,65 +1213,802 @@ vm_try_handle_fault (struct intr_frame *f UNUSED, void *addr UNUSED,
 void
 vm_dealloc_page (struct page *page) {
 	destroy (page);
-	free (page);
+	kmem_cache_free (page_slab, page);
 }
 
 /* Claim the page that allocate on VA. */
 bool
 vm_claim_page (void *va UNUSED) {
 	struct page *page = NULL;
+	bool succ;
 	/* TODO: Fill this function */
-	page = malloc(sizeof(struct page));
+	page = kmem_cache_alloc(page_slab);
 	page->va = va;
 	page->writable = true;
+	page->cow_writable = true;
+	page->busy = false;
+	page->fork_pending = false;
+	page->advice = VM_ADV_NORMAL;
+	page->mlocked = false;
 	page->owner = thread_current();
 	spt_insert_page(&thread_current()->spt, page);
 
-	return vm_do_claim_page (page);
+	vm_page_busy(page);
+	succ = vm_do_claim_page (page);
+	vm_page_unbusy(page);
+	return succ;
 }
 
-/* Claim the PAGE and set up the mmu. */
+/* Claim the PAGE, which the caller holds busy, and set up the mmu.
+ * The contents are read in before the page is mapped, so nothing
+ * sees the frame half filled. */
 static bool
 vm_do_claim_page (struct page *page) {
-	struct frame *frame = vm_get_frame ();
+	return vm_claim_page_with (page, vm_get_frame ());
+}
+
+/* Fills FRAME with the contents of PAGE, which the caller holds busy,
+ * and maps it. */
+static bool
+vm_claim_page_with (struct page *page, struct frame *frame) {
 	bool succ;
-	/* Set links */
-	frame->page = page;
+
 	page->frame = frame;
+	if (page->operations->type == VM_UNINIT)
+		vm_initialize_page(page, frame->kva);
+	succ = swap_in (page, frame->kva);
 
 	/* TODO: Insert page table entry to map page's VA to frame's PA. */
 	// setup MMU = add the mapping from the virtual address to the physical address in the page table
-	succ = pml4_set_page(thread_current()->pml4, page->va, frame->kva, page->writable);
-	if (page->operations->type == VM_UNINIT && page->uninit.init != NULL)
-		page->uninit.init(page, page->uninit.aux);
+	return vm_map_frame(page, frame) && succ;
+}
 
-	page->uninit.page_initializer(page, page_get_type(page), frame->kva);
+/* Turns the uninit PAGE into a page of its final type. */
+static void
+vm_initialize_page (struct page *page, void *kva) {
+	/* Fetch first, the initializers overwrite the union */
+	bool (*initializer)(struct page *, enum vm_type, void *) = page->uninit.page_initializer;
+	vm_initializer *init = page->uninit.init;
+	enum vm_type type = page->uninit.type;
+	void *aux = page->uninit.aux;
+
+	initializer(page, type, kva);
+	if (init != NULL)
+		init(page, aux);
+}
+
+/* Returns true if PAGE is a VM_TEXT page. */
+static bool
+page_is_text (struct page *page) {
+	if (page->operations->type == VM_UNINIT)
+		return (page->uninit.type & VM_TEXT) != 0;
+	return VM_TYPE(page->operations->type) == VM_ANON && page->anon.text_file != NULL;
+}
+
+/* Returns true if PAGE is a page of a file mapping. */
+static bool
+page_is_file (struct page *page) {
+	if (page->operations->type == VM_UNINIT)
+		return VM_TYPE(page->uninit.type) == VM_FILE;
+	return VM_TYPE(page->operations->type) == VM_FILE;
+}
+
+/* Claims PAGE, which the caller holds busy, in the way its type asks. */
+static bool
+vm_claim (struct page *page) {
+	if (page_is_text(page))
+		return vm_claim_text_page(page, false);
+	if (page_is_file(page))
+		return vm_claim_file_page(page, false);
+	return vm_do_claim_page(page);
+}
+
+static uint64_t
+text_hash (const struct hash_elem *e, void *aux UNUSED) {
+	const struct frame *f = hash_entry(e, struct frame, text_elem);
+	return hash_bytes(&f->text_inode, sizeof f->text_inode) ^ hash_int(f->text_ofs);
+}
+
+static bool
+text_less (const struct hash_elem *a_, const struct hash_elem *b_, void *aux UNUSED) {
+	const struct frame *a = hash_entry(a_, struct frame, text_elem);
+	const struct frame *b = hash_entry(b_, struct frame, text_elem);
+
+	if (a->text_inode != b->text_inode)
+		return a->text_inode < b->text_inode;
+	return a->text_ofs < b->text_ofs;
+}
+
+/* Returns the shared frame holding OFS of INODE, or NULL.
+ * Must hold frame_lock. */
+static struct frame *
+text_lookup (struct inode *inode, off_t ofs) {
+	struct frame key;
+	struct hash_elem *e;
+
+	key.text_inode = inode;
+	key.text_ofs = ofs;
+	e = hash_find(&text_table, &key.text_elem);
+	return e != NULL ? hash_entry(e, struct frame, text_elem) : NULL;
+}
+
+/* Takes FRAME out of the text table, if it is there.
+ * Must hold frame_lock. */
+static void
+text_forget (struct frame *frame) {
+	if (frame->text_inode == NULL)
+		return;
+	hash_delete(&text_table, &frame->text_elem);
+	frame->text_inode = NULL;
+}
+
+/* Maps PAGE, which the caller holds busy, on the shared frame FRAME.
+ * Must hold frame_lock. */
+static bool
+frame_map_shared (struct page *page, struct frame *frame) {
+	page->frame = frame;
 	page->swapped_out = false;
-	list_push_front(&frame->referers, &page->referer_elem);
+	frame_ref(frame, page);
+	return pml4_set_page(page->owner->pml4, page->va, frame->kva,
+			page->writable && page->cow_writable);
+}
 
-	return swap_in (page, frame->kva);
+/* Claims the VM_TEXT page PAGE, which the caller holds busy.  If
+ * another process has the same part of the executable in memory, PAGE
+ * is mapped on that frame; otherwise it is read into a new frame that
+ * is published for the next ones.  A SPECULATIVE claim only uses a
+ * frame that is free already and returns false if there is none. */
+static bool
+vm_claim_text_page (struct page *page, bool speculative) {
+	struct anon_page *anon;
+	struct inode *inode;
+	struct frame *frame, *shared;
+	bool succ;
+
+	if (page->operations->type == VM_UNINIT)
+		vm_initialize_page(page, NULL);
+	anon = &page->anon;
+	inode = file_get_inode(anon->text_file);
+
+	lock_acquire(&frame_lock);
+	shared = text_lookup(inode, anon->text_ofs);
+	if (shared != NULL) {
+		succ = frame_map_shared(page, shared);
+		text_shared++;
+		lock_release(&frame_lock);
+		return succ;
+	}
+	lock_release(&frame_lock);
+
+	frame = speculative ? vm_try_get_frame() : vm_get_frame();
+	if (frame == NULL)
+		return false;
+	lock_acquire(&filesys_lock);
+	file_read_at(anon->text_file, frame->kva, anon->text_read_bytes, anon->text_ofs);
+	lock_release(&filesys_lock);
+	memset(frame->kva + anon->text_read_bytes, 0, PGSIZE - anon->text_read_bytes);
+	text_reads++;
+
+	/* Someone may have read the same page in the meantime. */
+	lock_acquire(&frame_lock);
+	shared = text_lookup(inode, anon->text_ofs);
+	if (shared != NULL) {
+		succ = frame_map_shared(page, shared);
+		lock_release(&frame_lock);
+		free_frame(frame);
+		return succ;
+	}
+	frame->text_inode = inode;
+	frame->text_ofs = anon->text_ofs;
+	hash_insert(&text_table, &frame->text_elem);
+	frame->page = page;
+	lru_push(frame);
+	succ = frame_map_shared(page, frame);
+	lock_release(&frame_lock);
+	return succ;
 }
 
-unsigned
-page_hash (const struct hash_elem *h_el, void *aux UNUSED) {
-  const struct page *p = hash_entry (h_el, struct page, spt_hash_elem);
-  return hash_bytes (&p->va, sizeof p->va);
+/* Returns true if the file page PAGE holds exactly what the page
+ * cache holds for its offset: a whole page of a regular file, or the
+ * last page of the file followed by zeros. */
+static bool
+file_page_cacheable (struct page *page) {
+	struct file_page *file_page = &page->file;
+	struct inode *inode = file_get_inode(file_page->file);
+	off_t left = inode_length(inode) - file_page->offset;
+
+	return inode->data.is_file && file_page->offset % PGSIZE == 0 && left > 0
+			&& file_page->data_bytes == (left < PGSIZE ? (uint32_t) left : PGSIZE);
 }
 
+/* Claims the file page PAGE, which the caller holds busy, by mapping
+ * the frame that the page cache has for the same part of the file,
+ * reading it in first if needed, so that read() and every mapping of
+ * the file share one copy; writes to a writable mapping land in the
+ * cache right away.  Pages that differ from the file, such as the
+ * end of a mapping shorter than the file, get a frame of their own.
+ * A SPECULATIVE claim only uses a frame that is free already. */
+static bool
+vm_claim_file_page (struct page *page, bool speculative) {
+	struct frame *frame;
+	struct page *cached;
+	bool succ;
+
+	if (page->operations->type == VM_UNINIT)
+		vm_initialize_page(page, NULL);
+	/* The frame is taken first: evicting needs filesys_lock. */
+	frame = speculative ? vm_try_get_frame() : vm_get_frame();
+	if (frame == NULL)
+		return false;
+	if (!file_page_cacheable(page))
+		return vm_claim_page_with(page, frame);
+
+	lock_acquire(&filesys_lock);
+	cached = page_cache_get(file_get_inode(page->file.file), page->file.offset);
+	lock_acquire(&frame_lock);
+	if (cached == NULL || cached->busy) {
+		/* The cached frame is on its way out. */
+		lock_release(&frame_lock);
+		lock_release(&filesys_lock);
+		return vm_claim_page_with(page, frame);
+	}
+	if (cached->frame != NULL) {
+		succ = frame_map_shared(page, cached->frame);
+		lock_release(&frame_lock);
+		lock_release(&filesys_lock);
+		free_frame(frame);
+		cache_mapped++;
+		return succ;
+	}
+	lock_release(&frame_lock);
+
+	swap_in(cached, frame->kva);
+	lock_acquire(&frame_lock);
+	frame->page = cached;
+	cached->frame = frame;
+	frame_ref(frame, cached);
+	lru_push(frame);
+	succ = frame_map_shared(page, frame);
+	lock_release(&frame_lock);
+	lock_release(&filesys_lock);
+	cache_mapped++;
+	return succ;
+}
+
+/* Copies SIZE bytes between BUF and the page cache page PAGE at OFS,
+ * into PAGE if TO_PAGE.  Returns false, and copies nothing, if PAGE
+ * is not in memory or is being evicted.  BUF must not fault. */
+bool
+vm_cache_copy (struct page *page, off_t ofs, void *buf, size_t size, bool to_page) {
+	uint8_t *kva;
+
+	ASSERT (ofs + size <= PGSIZE);
+
+	lock_acquire(&frame_lock);
+	if (page->frame == NULL || page->busy) {
+		lock_release(&frame_lock);
+		return false;
+	}
+	kva = (uint8_t *) page->frame->kva + ofs;
+	if (to_page)
+		memmove(kva, buf, size);
+	else
+		memmove(buf, kva, size);
+	lock_release(&frame_lock);
+	return true;
+}
+
+/* Reads the page cache page PAGE into a frame that is free already.
+ * Returns false if there is none, or if PAGE is in memory already or
+ * being evicted.  Must hold filesys_lock. */
+bool
+vm_cache_fill (struct page *page) {
+	struct frame *frame;
+
+	lock_acquire(&frame_lock);
+	if (page->frame != NULL || page->busy) {
+		lock_release(&frame_lock);
+		return false;
+	}
+	lock_release(&frame_lock);
+	if ((frame = vm_try_get_frame()) == NULL)
+		return false;
+
+	/* Only holders of filesys_lock give PAGE a frame. */
+	swap_in(page, frame->kva);
+	lock_acquire(&frame_lock);
+	frame->page = page;
+	page->frame = frame;
+	frame_ref(frame, page);
+	lru_push(frame);
+	lock_release(&frame_lock);
+	return true;
+}
+
+/* Takes the page cache page PAGE, which nothing maps any more, off
+ * its frame.  Returns false if the frame is being evicted; PAGE is
+ * then marked as let go and freed by the evictor instead. */
+bool
+vm_cache_detach (struct page *page) {
+	lock_acquire(&frame_lock);
+	if (page->busy) {
+		page->page_cache.inode = NULL;
+		lock_release(&frame_lock);
+		return false;
+	}
+	if (page->frame != NULL && frame_unref(page))
+		clear_frame(page->frame);
+	page->frame = NULL;
+	lock_release(&frame_lock);
+	return true;
+}
+
+/* Maps the shared zero frame read-only at PAGE, an untouched
+ * zero-fill page that is being read.  A real frame is allocated by
+ * vm_handle_wp on its first write. */
+static bool
+vm_map_zero_page (struct page *page) {
+	bool succ;
+
+	vm_initialize_page(page, zero_frame->kva);
+	page->cow_writable = false;
+	page->swapped_out = false;
+	lock_acquire(&frame_lock);
+	page->frame = zero_frame;
+	frame_ref(zero_frame, page);
+	succ = pml4_set_page(page->owner->pml4, page->va, zero_frame->kva, false);
+	lock_release(&frame_lock);
+	return succ;
+}
+
+/* Returns true if PAGE may be populated by fault-around: a page of a
+ * read-only segment of the executable.  Writable data, BSS and mmaps
+ * keep being loaded one page at a time, since programs may rely on
+ * untouched pages of those not being resident. */
+static bool
+fault_around_eligible (struct page *page) {
+	return page_is_text(page) && page->advice != VM_ADV_RANDOM;
+}
+
+/* Populates the pages around FAULTED, within the aligned block of
+ * vm_fault_around pages that holds it, that can be brought in cheaply:
+ * they only get a frame that is free already, never one that has to
+ * be evicted, and pages someone else is working on are left alone. */
+static void
+vm_fault_around_pages (struct page *faulted) {
+	struct supplemental_page_table *spt = &faulted->owner->spt;
+	uint8_t *start, *va;
+
+	if (vm_fault_around <= 1)
+		return;
+	start = (uint8_t *) faulted->va - pg_no(faulted->va) % vm_fault_around * PGSIZE;
+	for (va = start; va < start + vm_fault_around * PGSIZE && is_user_vaddr(va); va += PGSIZE) {
+		struct vm_region *region;
+		struct page *page;
+
+		if (va == faulted->va)
+			continue;
+		if ((page = spt_find_page(spt, va)) == NULL) {
+			region = region_find(&spt->regions, va);
+			if (region == NULL || !(region->type & VM_TEXT)
+					|| (page = region_fault_in(region, va)) == NULL)
+				continue;
+		}
+		if (!fault_around_eligible(page) || !vm_page_try_busy(page))
+			continue;
+		if (page->frame == NULL && fault_around_eligible(page)) {
+			if (!vm_claim_text_page(page, true)) {
+				vm_page_unbusy(page);
+				break;
+			}
+			fault_around_pages++;
+		}
+		vm_page_unbusy(page);
+	}
+}
+
+/* Claims PAGE, which the caller holds busy, on a frame that is free
+ * already.  Returns false if there is none. */
+static bool
+vm_claim_speculative (struct page *page) {
+	struct frame *frame;
+
+	if (page_is_text(page))
+		return vm_claim_text_page(page, true);
+	if (page_is_file(page))
+		return vm_claim_file_page(page, true);
+	if ((frame = vm_try_get_frame()) == NULL)
+		return false;
+	memset(frame->kva, 0, PGSIZE);
+	return vm_claim_page_with(page, frame);
+}
+
+/* Returns the lowest address in [VA, END) that has a page or a region
+ * of SPT, or END. */
+static void *
+next_mapped (struct supplemental_page_table *spt, void *va, void *end) {
+	struct vm_region *region = region_find_next(&spt->regions, va);
+	struct page *page = spt_find_next(spt, va, end);
+
+	if (region != NULL && region->start < end)
+		end = region->start;
+	if (page != NULL && page->va < end)
+		end = page->va;
+	return end;
+}
+
+/* Brings the pages of the current process in [START, END) into
+ * memory in one pass, creating the untouched pages of regions on the
+ * way, so that the range takes no faults afterwards.  A SPECULATIVE
+ * pass only uses frames that are free already, skips pages someone
+ * else is working on and stops when memory runs short; otherwise
+ * frames are evicted as a fault would.  Returns the number of pages
+ * brought in. */
+size_t
+vm_populate (void *start, void *end, bool speculative) {
+	struct supplemental_page_table *spt = &thread_current()->spt;
+	struct vm_region *region;
+	struct page *page;
+	uint8_t *va;
+	size_t cnt = 0;
+	bool succ;
+
+	for (va = start; va < (uint8_t *) end && is_user_vaddr(va); va += PGSIZE) {
+		if ((page = spt_find_page(spt, va)) == NULL) {
+			region = region_find(&spt->regions, va);
+			if (region == NULL) {
+				va = (uint8_t *) next_mapped(spt, va, end) - PGSIZE;
+				continue;
+			}
+			if ((page = region_fault_in(region, va)) == NULL)
+				break;
+		}
+		if (page_get_type(page) == VM_FILE && page->file.file == NULL)
+			continue;
+		/* Zeros come from the zero frame when they are read. */
+		if (speculative && page->operations->type == VM_UNINIT
+				&& (page->uninit.type & VM_ZERO_FILL))
+			continue;
+		if (page->fork_pending)
+			fork_push(page);
+		if (!speculative)
+			vm_page_busy(page);
+		else if (!vm_page_try_busy(page))
+			continue;
+		succ = true;
+		if (page->frame == NULL) {
+			succ = speculative ? vm_claim_speculative(page) : vm_claim(page);
+			if (succ)
+				cnt++;
+		}
+		vm_page_unbusy(page);
+		if (!succ)
+			break;
+	}
+	populated_pages += cnt;
+	return cnt;
+}
+
+/* Sets the advice of the regions of the current process in [START,
+ * END) and of the pages that exist there already. */
 bool
-page_less (const struct hash_elem *a_, const struct hash_elem *b_, void *aux UNUSED) {
-  const struct page *a = hash_entry (a_, struct page, spt_hash_elem);
-  const struct page *b = hash_entry (b_, struct page, spt_hash_elem);
+vm_advise (void *start, void *end, enum vm_advice advice) {
+	struct supplemental_page_table *spt = &thread_current()->spt;
+	struct page *page;
 
-  return a->va < b->va;
+	if (!region_advise(&spt->regions, start, end, advice))
+		return false;
+	for (page = spt_find_next(spt, start, end); page != NULL;
+			page = spt_find_next(spt, page->va + PGSIZE, end))
+		if (region_find(&spt->regions, page->va) != NULL)
+			page->advice = advice;
+	return true;
+}
+
+/* Drops the pages of the current process in [START, END), freeing
+ * their frames and swap slots, and writes back the dirty ones of
+ * file mappings.  The next touch makes them again from their region,
+ * so pages outside regions, the stack, are kept. */
+void
+vm_drop_range (void *start, void *end) {
+	struct thread *curr = thread_current();
+	struct supplemental_page_table *spt = &curr->spt;
+	struct file_page *fp;
+	struct mmu_gather tlb;
+	struct page *page;
+	void *va;
+
+	mmu_gather_start(&tlb, curr->pml4);
+	for (va = start; (page = spt_find_next(spt, va, end)) != NULL; ) {
+		va = page->va + PGSIZE;
+		if (region_find(&spt->regions, page->va) == NULL)
+			continue;
+		if (page->fork_pending)
+			fork_push(page);
+		vm_page_busy(page);
+		fp = &page->file;
+		if (VM_TYPE(page->operations->type) == VM_FILE && page->frame != NULL
+				&& ((page->frame->flags & FRAME_DIRTY)
+					|| pml4_is_dirty(curr->pml4, page->va))) {
+			lock_acquire(&filesys_lock);
+			file_write_at(fp->file, page->frame->kva, fp->data_bytes, fp->offset);
+			lock_release(&filesys_lock);
+		}
+		if (VM_TYPE(page->operations->type) == VM_FILE && fp->file != NULL) {
+			lock_acquire(&filesys_lock);
+			file_close(fp->file);
+			lock_release(&filesys_lock);
+			fp->file = NULL;
+		}
+		spt_remove_page(spt, page);
+		dropped_pages++;
+	}
+	mmu_gather_finish(&tlb);
+	fork_forget(start, end);
+}
+
+/* Faults in the page of the current process at VA, for writing if
+ * WRITE, and pins its frame.  Returns false if VA is not mapped, or
+ * not writable for WRITE. */
+static bool
+vm_pin_page (void *va, bool write) {
+	struct thread *curr = thread_current();
+	struct page *page;
+	bool pinned = false;
+
+	if (!is_user_vaddr(va))
+		return false;
+	while (!pinned) {
+		page = spt_find_page(&curr->spt, va);
+		if (page == NULL && region_find(&curr->spt.regions, va) == NULL) {
+			/* A buffer on the stack below what was ever touched. */
+			if ((uint8_t *) va < (uint8_t *) USER_STACK - (1 << 20))
+				return false;
+			vm_stack_growth(va);
+			page = spt_find_page(&curr->spt, va);
+		}
+		if (page == NULL || page->frame == NULL
+				|| (write && !pml4_is_writable(curr->pml4, va))) {
+			if (!vm_fault_page(va, write, page == NULL || page->frame == NULL))
+				return false;
+			page = spt_find_page(&curr->spt, va);
+		}
+
+		/* Eviction picks its victims under frame_lock as well, and
+		 * never a pinned frame.  A busy page may be on its way out, so
+		 * wait and look again. */
+		lock_acquire(&frame_lock);
+		while (page->busy)
+			cond_wait(&page_idle, &frame_lock);
+		if (page->frame != NULL
+				&& (!write || pml4_is_writable(curr->pml4, va))) {
+			page->frame->pin_cnt++;
+			pinned = true;
+		}
+		lock_release(&frame_lock);
+	}
+	return true;
+}
+
+/* Drops the pins that vm_pin_range took on [UADDR, UADDR + SIZE). */
+void
+vm_unpin_range (const void *uaddr, size_t size) {
+	struct supplemental_page_table *spt = &thread_current()->spt;
+	uint8_t *va = pg_round_down(uaddr);
+	struct page *page;
+
+	if (size == 0)
+		return;
+	for (; va < (uint8_t *) uaddr + size; va += PGSIZE) {
+		page = spt_find_page(spt, va);
+		lock_acquire(&frame_lock);
+		ASSERT (page != NULL && page->frame != NULL && page->frame->pin_cnt > 0);
+		page->frame->pin_cnt--;
+		lock_release(&frame_lock);
+	}
+}
+
+/* Faults in the user buffer [UADDR, UADDR + SIZE) of the current
+ * process and pins it, so that the kernel can use it without
+ * faulting, for instance while it holds filesys_lock.  The buffer
+ * must be writable if WRITE is true.  Returns false, with nothing
+ * pinned, if the buffer is not mapped as asked. */
+bool
+vm_pin_range (const void *uaddr, size_t size, bool write) {
+	uint8_t *start = pg_round_down(uaddr), *va;
+
+	if (size == 0)
+		return true;
+	if ((uint8_t *) uaddr + size < (uint8_t *) uaddr)
+		return false;
+	for (va = start; va < (uint8_t *) uaddr + size; va += PGSIZE)
+		if (!vm_pin_page(va, write)) {
+			if (va > start)
+				vm_unpin_range(start, va - start);
+			return false;
+		}
+	buffer_pins += (va - start) / PGSIZE;
+	return true;
+}
+
+/* Locks the pages of the current process in [START, END) in memory
+ * until vm_munlock, exit or unmap.  At most half of the user pool
+ * may be locked.  Returns false, with no page of the range newly
+ * locked, if a page is not mapped or the limit would be exceeded. */
+bool
+vm_mlock (void *start, void *end) {
+	struct supplemental_page_table *spt = &thread_current()->spt;
+	size_t new_cnt = ((uint8_t *) end - (uint8_t *) start) / PGSIZE;
+	struct page *page;
+	uint8_t *va;
+
+	for (page = spt_find_next(spt, start, end); page != NULL;
+			page = spt_find_next(spt, page->va + PGSIZE, end))
+		if (page->mlocked)
+			new_cnt--;
+	if (mlocked_pages + new_cnt > frame_cnt / 2)
+		return false;
+
+	/* Pin the whole range first, which either succeeds or pins
+	 * nothing, then hand the pins over to the pages. */
+	if (!vm_pin_range(start, (uint8_t *) end - (uint8_t *) start, false))
+		return false;
+	buffer_pins -= ((uint8_t *) end - (uint8_t *) start) / PGSIZE;
+	for (va = start; va < (uint8_t *) end; va += PGSIZE) {
+		page = spt_find_page(spt, va);
+		lock_acquire(&frame_lock);
+		if (page->mlocked)
+			page->frame->pin_cnt--;
+		else {
+			page->mlocked = true;
+			mlocked_pages++;
+		}
+		lock_release(&frame_lock);
+	}
+	return true;
+}
+
+/* Unlocks the pages of the current process in [START, END). */
+void
+vm_munlock (void *start, void *end) {
+	struct supplemental_page_table *spt = &thread_current()->spt;
+	struct page *page;
+
+	for (page = spt_find_next(spt, start, end); page != NULL;
+			page = spt_find_next(spt, page->va + PGSIZE, end)) {
+		lock_acquire(&frame_lock);
+		if (page->mlocked) {
+			page->frame->pin_cnt--;
+			page->mlocked = false;
+			mlocked_pages--;
+		}
+		lock_release(&frame_lock);
+	}
+}
+
+/* Returns true if the 2 MB block at BASE may be mapped as one huge
+ * page on a fault in REGION: it lies within the region, none of its
+ * pages exist yet, and it holds only zeros of an anonymous region that
+ * are being written.  Text and file mappings keep 4 KB pages, so that
+ * they can be shared with other processes and with the page cache. */
+static bool
+huge_eligible (struct supplemental_page_table *spt, struct vm_region *region,
+		uint8_t *base, bool write) {
+	if (!vm_huge_pages || (region->type & VM_TEXT) || spt->lazy_parent != NULL)
+		return false;
+	if (VM_TYPE(region->type) == VM_FILE)
+		return false;
+	if (base < (uint8_t *) region->start || base + HUGE_PGSIZE > (uint8_t *) region->end)
+		return false;
+	if (VM_TYPE(region->type) == VM_ANON
+			&& (!write || (size_t) (base - (uint8_t *) region->start) < region->file_bytes))
+		return false;
+	return spt_range_empty(spt, base, base + HUGE_PGSIZE);
+}
+
+/* Tries to serve the first fault at VA, in REGION, by mapping the
+ * whole 2 MB block around it on physically contiguous memory with a
+ * single page directory entry.  Each page of the block still gets its
+ * own struct page and frame, so eviction, fork and munmap keep working
+ * page by page: the first of them to change the mapping of one page
+ * splits the block into 4 KB entries.  Only memory that is free
+ * already is used.  Returns false if the fault has to be served with
+ * a 4 KB page instead. */
+static bool
+vm_try_huge (struct supplemental_page_table *spt, struct vm_region *region,
+		void *va, bool write) {
+	uint8_t *base = (uint8_t *) ((uint64_t) va & ~(HUGE_PGSIZE - 1));
+	struct frame *frame;
+	struct page *page;
+	uint8_t *kva;
+	size_t i;
+	bool huge;
+
+	if (!huge_eligible(spt, region, base, write))
+		return false;
+	if (palloc_free_cnt(PAL_USER) < HUGE_PAGE_CNT + vm_high_watermark
+			|| (kva = palloc_get_multiple_aligned(PAL_USER | PAL_ZERO,
+					HUGE_PAGE_CNT, HUGE_PAGE_CNT)) == NULL) {
+		huge_fallbacks++;
+		return false;
+	}
+	if (palloc_free_cnt(PAL_USER) < vm_low_watermark)
+		sema_up(&kswapd_sema);
+
+	for (i = 0; i < HUGE_PAGE_CNT; i++)
+		if (region_fault_in(region, base + i * PGSIZE) == NULL) {
+			palloc_free_multiple(kva, HUGE_PAGE_CNT);
+			return false;
+		}
+
+	/* The pages stay busy until they are mapped, so that nobody
+	 * evicts them in the meantime. */
+	for (i = 0; i < HUGE_PAGE_CNT; i++) {
+		page = spt_find_page(spt, base + i * PGSIZE);
+		frame = vm_frame_of(kva + i * PGSIZE);
+		init_frame_struct(frame);
+		vm_page_busy(page);
+		page->frame = frame;
+		vm_initialize_page(page, frame->kva);
+		swap_in(page, frame->kva);
+		lock_acquire(&frame_lock);
+		frame->page = page;
+		frame_ref(frame, page);
+		lru_push(frame);
+		lock_release(&frame_lock);
+	}
+
+	lock_acquire(&frame_lock);
+	huge = pml4_set_huge_page(thread_current()->pml4, base, kva, region->writable);
+	lock_release(&frame_lock);
+	if (huge)
+		huge_mapped++;
+	else
+		huge_fallbacks++;
+
+	for (i = 0; i < HUGE_PAGE_CNT; i++) {
+		page = spt_find_page(spt, base + i * PGSIZE);
+		if (!huge) {
+			lock_acquire(&frame_lock);
+			pml4_set_page(page->owner->pml4, page->va, page->frame->kva, page->writable);
+			lock_release(&frame_lock);
+		}
+		vm_page_unbusy(page);
+	}
+	return true;
+}
+
+/* Unmaps PAGE from its owner.  If its entry cannot be split off its
+ * 2 MB mapping for lack of memory, the whole mapping goes and the
+ * frames of the block take over its dirty bit; the other pages keep
+ * their frames and are mapped again with 4 KB entries on their next
+ * fault.  Must hold frame_lock. */
+static void
+vm_unmap_page (struct page *page) {
+	uint8_t *kva;
+	bool dirty;
+	size_t i;
+
+	if (pml4_clear_page(page->owner->pml4, page->va))
+		return;
+	kva = pml4_clear_huge_page(page->owner->pml4, page->va, &dirty);
+	if (kva == NULL)
+		return;
+	huge_torn_down++;
+	if (dirty)
+		for (i = 0; i < HUGE_PAGE_CNT; i++)
+			vm_frame_of(kva + i * PGSIZE)->flags |= FRAME_DIRTY;
 }
 
 /* Initialize new supplemental page table */
 void
 supplemental_page_table_init (struct supplemental_page_table *spt UNUSED) {
-	lock_acquire(&hash_lock);
-	hash_init(&spt->hash, page_hash, page_less, NULL);
-	lock_release(&hash_lock);
+	lock_init(&spt->lock);
+	spt->root = NULL;
+	swap_ra_init(&spt->ra);
+	region_tree_init(&spt->regions);
+	spt->lazy_child = NULL;
+	spt->lazy_parent = NULL;
 }
 
 void
@@ -388,60 +2017,328 @@ copy_page_struct(struct page* src, struct page* dst) {
 	dst->writable = src->writable;
 	dst->cow_writable = src->cow_writable = false;
 	dst->swapped_out = true;
+	dst->busy = false;
+	dst->fork_pending = false;
+	dst->advice = src->advice;
+	dst->mlocked = false;
 	dst->operations = src->operations;
 	dst->owner = thread_current();
 }
 
-void
-copy_spt_hash(struct hash_elem *e, void *aux) {
-	struct thread *curr = thread_current();
-	struct supplemental_page_table *dst = (struct supplemental_page_table*)aux;
-	struct page* page_original = hash_entry(e, struct page, spt_hash_elem);
+/* Copies PAGE_ORIGINAL of the parent into the page table of CHILD,
+ * sharing its frame until one of them writes to it.  Returns false if
+ * memory runs out. */
+static bool
+copy_spt_page(struct page *page_original, struct thread *curr) {
 	struct frame *frame;
 	struct page* page_copy;
 	void *copied_aux;
 
 
 	if (VM_TYPE(page_original->operations->type) == VM_UNINIT) {
+		ASSERT (curr == thread_current ());
 		copied_aux = page_original->uninit.copy(page_original, NULL);
-		vm_alloc_page_with_initializer (page_get_type(page_original), page_original->va,	
+		return vm_alloc_page_with_initializer (page_original->uninit.type, page_original->va,	
 										page_original->writable, page_original->uninit.init, copied_aux);
 	}	else {
-		page_copy = malloc(sizeof(struct page));
-		// frame = vm_get_frame();
-		lock_acquire(&cow_lock);
+		/* The frame is shared with the child, so a page that is out on
+		 * swap has to come back first. */
+		vm_page_busy(page_original);
+		if ((page_original->frame == NULL && !vm_claim(page_original))
+				|| (page_copy = kmem_cache_alloc(page_slab)) == NULL) {
+			vm_page_unbusy(page_original);
+			return false;
+		}
+		copy_page_struct(page_original, page_copy);
+		page_copy->owner = curr;
+		if (VM_TYPE(page_original->operations->type) == VM_FILE) {
+			copy_file_page(&page_original->file, &page_copy->file);
+			lock_acquire(&filesys_lock);
+			page_copy->file.file = file_reopen(page_original->file.file);
+			lock_release(&filesys_lock);
+		} else {
+			page_copy->anon.page_sec_idx = SWAP_SLOT_NONE;
+			page_copy->anon.zswap = NULL;
+			page_copy->anon.text_file = NULL;
+			if (page_original->anon.text_file != NULL) {
+				lock_acquire(&filesys_lock);
+				page_copy->anon.text_file = file_reopen(page_original->anon.text_file);
+				lock_release(&filesys_lock);
+				page_copy->anon.text_ofs = page_original->anon.text_ofs;
+				page_copy->anon.text_read_bytes = page_original->anon.text_read_bytes;
+			}
+		}
+
+		lock_acquire(&frame_lock);
 		frame = page_original->frame;
-		list_push_front(&frame->referers, &page_copy->referer_elem);
+		frame_ref(frame, page_copy);
 		frame->page = NULL;
+		/* The parent's entry is rewritten without its dirty bit. */
+		if (pml4_is_dirty(page_original->owner->pml4, page_original->va))
+			frame->flags |= FRAME_DIRTY;
 		page_copy->frame = frame;
-		copy_page_struct(page_original, page_copy);
-
-		memcpy(frame->kva, page_original->frame->kva, PGSIZE);
-		pml4_clear_page(curr->pml4, page_copy->va);
+		vm_unmap_page(page_copy);
 		pml4_set_page(page_original->owner->pml4, page_original->va, frame->kva, false);
 		pml4_set_page(curr->pml4, page_copy->va, frame->kva, false);
-		
-		if (VM_TYPE(page_original->operations->type) == VM_FILE)
-			copy_file_page(&page_original->file, &page_copy->file);
-		lock_release(&cow_lock);
-		spt_insert_page(&curr->spt.hash, page_copy);
+		lock_release(&frame_lock);
+		vm_page_unbusy(page_original);
+		spt_insert_page(&curr->spt, page_copy);
+	}
+	return true;
+}
+
+/* Lazy fork.  A child made by fork does not copy the pages that its
+ * parent has in regions right away.  They stay with the parent,
+ * write-protected and marked fork_pending, and the child copies each
+ * one when it first needs it (fork_pull).  Before the parent changes
+ * or drops a pending page, it hands the copy over (fork_push).  A
+ * parent has pending pages for one child at most: forking again, or
+ * exiting, hands all of them over first.  Pages outside regions, the
+ * stack, are few and copied at once.
+ *
+ * This saves the copies, not the walk, so it is a lazy copy rather
+ * than a fork of constant cost.  The child gets its own copy of every
+ * region descriptor (region_tree_copy), fork still visits every page
+ * of the parent to write-protect it, and a parent that forks again
+ * first shares with the previous child every page that child has not
+ * taken yet.  The cost of a fork stays linear in the regions and
+ * pages of the parent. */
+struct fork_link {
+	struct lock lock;			/* Protects the fields and fork_pending. */
+	struct thread *parent;		/* NULL once the parent let go. */
+	struct thread *child;		/* NULL once the child let go. */
+	bool failed;				/* A page could not be handed over. */
+	int refs;
+};
+
+/* Returns the pending page of lowest address in [START, END) of SPT,
+ * or NULL.  Must hold the lock of the link the pages are pending
+ * for, which keeps their owner from freeing them. */
+static struct page *
+spt_next_pending (struct supplemental_page_table *spt, void *start, void *end) {
+	struct page *page = NULL;
+
+	lock_acquire(&spt->lock);
+	while (spt->root != NULL
+			&& (page = spt_next_in(spt->root, SPT_LEVELS - 1, 0, (uint64_t) start, (uint64_t) end)) != NULL
+			&& !page->fork_pending)
+		start = page->va + PGSIZE;
+	lock_release(&spt->lock);
+	return page;
+}
+
+/* Gives the copy of PAGE to the child that has yet to take it, if
+ * any.  Called by the owner of PAGE before it maps PAGE writable or
+ * drops it.  If memory runs out, the child is left without the page
+ * and dies on its next fault in a region. */
+void
+fork_push (struct page *page) {
+	struct fork_link *link = page->owner->spt.lazy_child;
+
+	if (link == NULL) {
+		page->fork_pending = false;
+		return;
+	}
+	lock_acquire(&link->lock);
+	if (page->fork_pending) {
+		page->fork_pending = false;
+		/* The child makes untouched pages again from its regions. */
+		if (link->child != NULL && page->operations->type != VM_UNINIT
+				&& !copy_spt_page(page, link->child))
+			link->failed = true;
+	}
+	lock_release(&link->lock);
+}
+
+/* Copies the page at VA that the parent of the current process had
+ * when it forked us, if it has not been copied yet.  Sets *COPY to
+ * our page at VA, or NULL if it has to be made from its region.
+ * Returns false if a page of the parent could not be copied, now or
+ * before. */
+bool
+fork_pull (void *va, struct page **copy) {
+	struct thread *curr = thread_current();
+	struct fork_link *link = curr->spt.lazy_parent;
+	struct page *page;
+	bool succ = true;
+
+	*copy = NULL;
+	if (link == NULL)
+		return true;
+	lock_acquire(&link->lock);
+	if (link->failed)
+		succ = false;
+	/* The parent may have handed it over since we looked. */
+	else if ((*copy = spt_find_page(&curr->spt, va)) == NULL
+			&& link->parent != NULL
+			&& (page = spt_next_pending(&link->parent->spt, va, va + PGSIZE)) != NULL) {
+		page->fork_pending = false;
+		if (page->operations->type != VM_UNINIT) {
+			succ = copy_spt_page(page, curr);
+			*copy = spt_find_page(&curr->spt, va);
+		}
+	}
+	lock_release(&link->lock);
+	return succ;
+}
+
+/* Gives up the copies of the parent's pages in [START, END), which
+ * the current process unmaps. */
+void
+fork_forget (void *start, void *end) {
+	struct fork_link *link = thread_current()->spt.lazy_parent;
+	struct page *page;
+
+	if (link == NULL)
+		return;
+	lock_acquire(&link->lock);
+	while (link->parent != NULL
+			&& (page = spt_next_pending(&link->parent->spt, start, end)) != NULL) {
+		page->fork_pending = false;
+		start = page->va + PGSIZE;
+	}
+	lock_release(&link->lock);
+}
+
+static void
+fork_link_put (struct fork_link *link) {
+	bool last;
+
+	lock_acquire(&link->lock);
+	last = --link->refs == 0;
+	lock_release(&link->lock);
+	if (last)
+		free(link);
+}
+
+/* Ends the lazy copies of the pages of T in both directions.  Its
+ * child gets every page still pending, and if SETTLE is true, so does
+ * T from its parent; otherwise T no longer wants them.  T is either
+ * the current process or a parent that waits for it in fork.  Returns
+ * false if T could not get all of its pages; T then keeps its link
+ * to the parent, so that it dies on its next fault in a region. */
+static bool
+fork_detach (struct thread *t, bool settle) {
+	struct supplemental_page_table *spt = &t->spt;
+	struct fork_link *link;
+	struct page *page;
+
+	if ((link = spt->lazy_child) != NULL) {
+		lock_acquire(&link->lock);
+		for (page = spt_next_pending(spt, NULL, (void *) KERN_BASE); page != NULL;
+				page = spt_next_pending(spt, page->va + PGSIZE, (void *) KERN_BASE)) {
+			page->fork_pending = false;
+			if (link->child != NULL && !link->failed && page->operations->type != VM_UNINIT
+					&& !copy_spt_page(page, link->child))
+				link->failed = true;
+		}
+		link->parent = NULL;
+		lock_release(&link->lock);
+		spt->lazy_child = NULL;
+		fork_link_put(link);
+	}
+	if ((link = spt->lazy_parent) != NULL) {
+		lock_acquire(&link->lock);
+		while (settle && !link->failed && link->parent != NULL
+				&& (page = spt_next_pending(&link->parent->spt, NULL, (void *) KERN_BASE)) != NULL) {
+			page->fork_pending = false;
+			if (page->operations->type != VM_UNINIT && !copy_spt_page(page, t))
+				link->failed = true;
+		}
+		if (settle && link->failed) {
+			lock_release(&link->lock);
+			return false;
+		}
+		link->child = NULL;
+		lock_release(&link->lock);
+		spt->lazy_parent = NULL;
+		fork_link_put(link);
+	}
+	return true;
+}
+
+/* Leaves PAGE of the parent for the child to copy later, making it
+ * read-only in the meantime. */
+static void
+fork_defer_page (struct page *page) {
+	vm_page_busy(page);
+	page->fork_pending = true;
+	page->cow_writable = false;
+	lock_acquire(&frame_lock);
+	if (page->frame != NULL) {
+		/* The entry is rewritten without its dirty bit. */
+		if (pml4_is_dirty(page->owner->pml4, page->va))
+			page->frame->flags |= FRAME_DIRTY;
+		pml4_set_page(page->owner->pml4, page->va, page->frame->kva, false);
 	}
+	lock_release(&frame_lock);
+	vm_page_unbusy(page);
 }
 
 /* Copy supplemental page table from src to dst */
 bool
 supplemental_page_table_copy (struct supplemental_page_table *dst UNUSED,
 		struct supplemental_page_table *src UNUSED) {
-	src->hash.aux = dst;
-	hash_apply(&src->hash, copy_spt_hash);
-	src->hash.aux = NULL;
-	return true;
+	struct thread *parent = thread_current()->parent;
+	struct fork_link *link;
+	struct mmu_gather tlb;
+	struct page *page;
+	bool succ = true;
+
+	ASSERT (dst == &thread_current ()->spt);
+	ASSERT (src == &parent->spt);
+
+	link = malloc(sizeof(struct fork_link));
+	if (link == NULL || !region_tree_copy(&dst->regions, &src->regions)
+			|| !fork_detach(parent, true)) {
+		free(link);
+		return false;
+	}
+	lock_init(&link->lock);
+	link->parent = parent;
+	link->child = thread_current();
+	link->failed = false;
+	link->refs = 2;
+
+	/* The parent waits for us, so SRC stays put.  Pages it still
+	 * owed to another child or took from its own parent were settled
+	 * above.  Its pages turn read-only; the TLB hears of it once.  If
+	 * a page cannot be copied, the link is still set up, so that
+	 * killing our page table lets go of the deferred pages. */
+	mmu_gather_start(&tlb, parent->pml4);
+	for (page = spt_find_next(src, NULL, (void *) KERN_BASE); page != NULL && succ;
+			page = spt_find_next(src, page->va + PGSIZE, (void *) KERN_BASE)) {
+		if (region_find(&src->regions, page->va) != NULL)
+			fork_defer_page(page);
+		else
+			succ = copy_spt_page(page, thread_current());
+	}
+	mmu_gather_finish(&tlb);
+	src->lazy_child = link;
+	dst->lazy_parent = link;
+	return succ;
 }
 
-void
-kill_spt_hash(struct hash_elem *e, void *aux) {
-	struct page* page = hash_entry(e, struct page, spt_hash_elem);
-	vm_dealloc_page(page);
+/* Frees every page under NODE, a node of LEVEL, and the nodes. */
+static void
+kill_spt_node(void **node, int level) {
+	struct page *page;
+	size_t i;
+
+	for (i = 0; i < SPT_SLOTS; i++) {
+		if (node[i] == NULL)
+			continue;
+		if (level > 0)
+			kill_spt_node(node[i], level - 1);
+		else {
+			page = node[i];
+			/* Wait for an eviction in flight; the page is never released. */
+			vm_page_busy(page);
+			vm_dealloc_page(page);
+		}
+		node[i] = NULL;
+	}
+	kmem_cache_free(spt_node_slab, node);
 }
 
 /* Free the resource hold by the supplemental page table */
@@ -449,15 +2346,34 @@ void
 supplemental_page_table_kill (struct supplemental_page_table *spt UNUSED) {
 	/* TODO: Destroy all the supplemental_page_table hold by thread and
 	 * TODO: writeback all the modified contents to the storage. */
-	lock_acquire(&hash_lock);
-	hash_clear(spt, kill_spt_hash);
-	lock_release(&hash_lock);
+	struct mmu_gather tlb;
+	void **root;
+
+	fork_detach(thread_current(), false);
+	/* Take the tree out first, so that the lock is not held while
+	 * dirty pages are written back. */
+	lock_acquire(&spt->lock);
+	root = spt->root;
+	spt->root = NULL;
+	lock_release(&spt->lock);
+	mmu_gather_start(&tlb, thread_current()->pml4);
+	if (root != NULL)
+		kill_spt_node(root, SPT_LEVELS - 1);
+	mmu_gather_finish(&tlb);
+	swap_ra_init(&spt->ra);
+	region_tree_destroy(&spt->regions);
 }
 
 void
 common_clear_page(struct page *page) {
-	pml4_clear_page(thread_current()->pml4, page->va);
-	list_remove(&page->referer_elem);
-	if (list_empty(&page->frame->referers)) 
+	lock_acquire(&frame_lock);
+	vm_unmap_page(page);
+	if (frame_unref(page))
 		clear_frame(page->frame);
+	if (page->mlocked) {
+		page->mlocked = false;
+		mlocked_pages--;
+	}
+	page->frame = NULL;
+	lock_release(&frame_lock);
 }
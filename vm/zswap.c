@@ -0,0 +1,342 @@
+/* zswap.c: Compressed in-memory cache in front of the swap disk.
+ *
+ * Anonymous pages picked for eviction are compressed into a pool of
+ * kernel pages before they go to the swap disk.  A fault on such a
+ * page only has to decompress it.  Pages whose 8-byte words are all
+ * the same (mostly zero pages) take no room in the pool at all.  When
+ * the pool is full, the least recently stored entries are spilled to
+ * the swap disk to make room. */
+
+#include "vm/zswap.h"
+#include <bitmap.h>
+#include <debug.h>
+#include <list.h>
+#include <round.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+#include "vm/vm.h"
+
+/* The pool is handed out in units of this many bytes. */
+#define ZSWAP_UNIT 64
+
+/* Pages that do not shrink below this size go to the disk. */
+#define ZSWAP_MAX_LEN (PGSIZE * 3 / 4)
+
+/* A compressed page. */
+struct zswap_entry {
+	struct page *page;			/* Owner of the contents. */
+	size_t unit;				/* First pool unit. */
+	size_t len;					/* Compressed bytes, 0 if same-filled. */
+	uint64_t fill;				/* Value of every word, if same-filled. */
+	struct list_elem lru_elem;	/* Element in lru_list. */
+};
+
+size_t zswap_pool_pages = 64;
+
+static uint8_t *pool;			/* zswap_pool_pages kernel pages. */
+static struct bitmap *used_units;	/* One bit per ZSWAP_UNIT bytes of pool. */
+static struct list lru_list;	/* Entries, most recently stored first. */
+static struct lock zswap_lock;
+
+/* Scratch buffers, protected by zswap_lock. */
+static uint8_t comp_buf[PGSIZE];
+static uint8_t spill_buf[PGSIZE];
+
+/* Statistics. */
+static long long stored_cnt;	/* Pages stored. */
+static long long same_cnt;		/* ...of which were same-filled. */
+static long long reject_cnt;	/* Pages that did not compress well. */
+static long long load_cnt;		/* Pages brought back from the pool. */
+static long long spill_cnt;		/* Entries written to the disk. */
+static long long comp_bytes;	/* Compressed size of the pages stored. */
+
+static size_t lz_compress (const uint8_t *src, uint8_t *dst, size_t max_len);
+static void lz_decompress (const uint8_t *src, size_t len, uint8_t *dst);
+
+/* Sets up the pool.  If it cannot be allocated, zswap stays off. */
+void
+zswap_init (void) {
+	list_init (&lru_list);
+	lock_init (&zswap_lock);
+	if (zswap_pool_pages == 0)
+		return;
+
+	pool = palloc_get_multiple (0, zswap_pool_pages);
+	used_units = bitmap_create (zswap_pool_pages * PGSIZE / ZSWAP_UNIT);
+	if (pool == NULL || used_units == NULL) {
+		printf ("zswap: cannot allocate a %zu page pool, disabled\n",
+				zswap_pool_pages);
+		if (pool != NULL)
+			palloc_free_multiple (pool, zswap_pool_pages);
+		if (used_units != NULL)
+			bitmap_destroy (used_units);
+		pool = NULL;
+	}
+}
+
+/* Returns the number of pool units taken by E. */
+static size_t
+entry_units (const struct zswap_entry *e) {
+	return DIV_ROUND_UP (e->len, ZSWAP_UNIT);
+}
+
+/* Copies the contents of E back into KVA. */
+static void
+entry_read (const struct zswap_entry *e, void *kva) {
+	if (e->len == 0) {
+		uint64_t *words = kva;
+		size_t i;
+
+		for (i = 0; i < PGSIZE / sizeof *words; i++)
+			words[i] = e->fill;
+	} else
+		lz_decompress (pool + e->unit * ZSWAP_UNIT, e->len, kva);
+}
+
+/* Unlinks E from its page and releases its pool units. */
+static void
+entry_free (struct zswap_entry *e) {
+	list_remove (&e->lru_elem);
+	if (e->len > 0)
+		bitmap_set_multiple (used_units, e->unit, entry_units (e), false);
+	e->page->anon.zswap = NULL;
+	free (e);
+}
+
+/* Writes the least recently stored entry to the swap disk.
+ * Returns false if the pool is empty. */
+static bool
+spill_one (void) {
+	struct zswap_entry *e;
+	struct page *page;
+
+	if (list_empty (&lru_list))
+		return false;
+	e = list_entry (list_back (&lru_list), struct zswap_entry, lru_elem);
+	page = e->page;
+	entry_read (e, spill_buf);
+	entry_free (e);
+	anon_swap_out_buffer (page, spill_buf);
+	spill_cnt++;
+	return true;
+}
+
+/* Returns true if every word of KVA holds the same value, which is
+ * stored in *FILL. */
+static bool
+page_same_filled (const void *kva, uint64_t *fill) {
+	const uint64_t *words = kva;
+	size_t i;
+
+	for (i = 1; i < PGSIZE / sizeof *words; i++)
+		if (words[i] != words[0])
+			return false;
+	*fill = words[0];
+	return true;
+}
+
+/* Tries to keep the contents of PAGE, found at KVA, in the pool.
+ * Returns false if zswap is off or the page does not compress well,
+ * in which case the caller has to write it to the disk. */
+bool
+zswap_store (struct page *page, const void *kva) {
+	struct zswap_entry *e;
+	size_t len = 0, unit = 0;
+	uint64_t fill = 0;
+
+	if (pool == NULL)
+		return false;
+
+	lock_acquire (&zswap_lock);
+	if (!page_same_filled (kva, &fill)) {
+		len = lz_compress (kva, comp_buf, ZSWAP_MAX_LEN);
+		if (len == 0) {
+			reject_cnt++;
+			lock_release (&zswap_lock);
+			return false;
+		}
+		while ((unit = bitmap_scan_and_flip (used_units, 0,
+						DIV_ROUND_UP (len, ZSWAP_UNIT), false)) == BITMAP_ERROR)
+			if (!spill_one ()) {
+				lock_release (&zswap_lock);
+				return false;
+			}
+		memcpy (pool + unit * ZSWAP_UNIT, comp_buf, len);
+	} else
+		same_cnt++;
+
+	e = malloc (sizeof *e);
+	if (e == NULL) {
+		if (len > 0)
+			bitmap_set_multiple (used_units, unit, DIV_ROUND_UP (len, ZSWAP_UNIT), false);
+		lock_release (&zswap_lock);
+		return false;
+	}
+	e->page = page;
+	e->unit = unit;
+	e->len = len;
+	e->fill = fill;
+	list_push_front (&lru_list, &e->lru_elem);
+	page->anon.zswap = e;
+	stored_cnt++;
+	comp_bytes += len;
+	lock_release (&zswap_lock);
+	return true;
+}
+
+/* Decompresses PAGE into KVA and drops it from the pool.  Returns
+ * false if PAGE is not in the pool. */
+bool
+zswap_load (struct page *page, void *kva) {
+	bool found;
+
+	lock_acquire (&zswap_lock);
+	found = page->anon.zswap != NULL;
+	if (found) {
+		entry_read (page->anon.zswap, kva);
+		entry_free (page->anon.zswap);
+		load_cnt++;
+	}
+	lock_release (&zswap_lock);
+	return found;
+}
+
+/* Drops PAGE from the pool without reading it. */
+void
+zswap_invalidate (struct page *page) {
+	lock_acquire (&zswap_lock);
+	if (page->anon.zswap != NULL)
+		entry_free (page->anon.zswap);
+	lock_release (&zswap_lock);
+}
+
+/* Prints zswap statistics.  DISK_LOADS is the number of swap-ins
+ * that had to go to the disk, for the hit rate. */
+void
+zswap_print_stats (long long disk_loads) {
+	if (pool == NULL)
+		return;
+	printf ("Zswap: %lld pages stored (%lld same-filled), %lld rejected, "
+			"%lld loaded, %lld spilled to disk\n",
+			stored_cnt, same_cnt, reject_cnt, load_cnt, spill_cnt);
+	printf ("Zswap: %lld%% of swap-ins hit the pool\n",
+			load_cnt + disk_loads > 0 ? load_cnt * 100 / (load_cnt + disk_loads) : 0);
+	printf ("Zswap: compressed to %lld%% of original size, %zu of %zu pool bytes in use\n",
+			stored_cnt > 0 ? comp_bytes * 100 / (stored_cnt * PGSIZE) : 0,
+			bitmap_count (used_units, 0, bitmap_size (used_units), true) * ZSWAP_UNIT,
+			zswap_pool_pages * PGSIZE);
+}
+
+/* A small LZ77 codec.  The compressed stream is a sequence of
+ * tokens, each starting with a control byte C:
+ *
+ *   C < 0x80: C + 1 literal bytes follow.
+ *   C >= 0x80: copy (C & 0x7f) + LZ_MIN_MATCH bytes from OFFSET bytes
+ *              back in the output; OFFSET follows as 2 bytes, little
+ *              endian.
+ *
+ * Matches are found through a hash of the next LZ_MIN_MATCH bytes,
+ * remembering only the last position with that hash. */
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_MATCH (0x7f + LZ_MIN_MATCH)
+#define LZ_MAX_LITERALS 0x80
+#define LZ_HASH_BITS 10
+
+static uint16_t lz_table[1 << LZ_HASH_BITS];	/* Protected by zswap_lock. */
+
+static inline size_t
+lz_hash (const uint8_t *p) {
+	uint32_t v = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Appends the literals SRC[START, END) to DST at *OUT.  Returns false
+ * if the output would exceed MAX_LEN. */
+static bool
+lz_flush_literals (const uint8_t *src, size_t start, size_t end,
+		uint8_t *dst, size_t *out, size_t max_len) {
+	while (start < end) {
+		size_t run = end - start < LZ_MAX_LITERALS ? end - start : LZ_MAX_LITERALS;
+
+		if (*out + 1 + run > max_len)
+			return false;
+		dst[(*out)++] = run - 1;
+		memcpy (dst + *out, src + start, run);
+		*out += run;
+		start += run;
+	}
+	return true;
+}
+
+/* Compresses the page at SRC into DST.  Returns the compressed length,
+ * or 0 if it would take more than MAX_LEN bytes. */
+static size_t
+lz_compress (const uint8_t *src, uint8_t *dst, size_t max_len) {
+	size_t pos = 0, lit = 0, out = 0;
+
+	memset (lz_table, 0xff, sizeof lz_table);
+	while (pos + LZ_MIN_MATCH <= PGSIZE) {
+		size_t h = lz_hash (src + pos);
+		size_t cand = lz_table[h];
+		size_t len = 0;
+
+		lz_table[h] = pos;
+		if (cand < pos && memcmp (src + cand, src + pos, LZ_MIN_MATCH) == 0) {
+			len = LZ_MIN_MATCH;
+			while (len < LZ_MAX_MATCH && pos + len < PGSIZE
+					&& src[cand + len] == src[pos + len])
+				len++;
+		}
+		if (len == 0) {
+			pos++;
+			continue;
+		}
+
+		if (!lz_flush_literals (src, lit, pos, dst, &out, max_len)
+				|| out + 3 > max_len)
+			return 0;
+		dst[out++] = 0x80 | (len - LZ_MIN_MATCH);
+		dst[out++] = (pos - cand) & 0xff;
+		dst[out++] = (pos - cand) >> 8;
+		pos += len;
+		lit = pos;
+	}
+	if (!lz_flush_literals (src, lit, PGSIZE, dst, &out, max_len))
+		return 0;
+	return out;
+}
+
+/* Decompresses the LEN bytes at SRC into the page at DST. */
+static void
+lz_decompress (const uint8_t *src, size_t len, uint8_t *dst) {
+	size_t in = 0, out = 0;
+
+	while (in < len) {
+		uint8_t c = src[in++];
+
+		if (c < 0x80) {
+			size_t run = c + 1;
+
+			ASSERT (out + run <= PGSIZE);
+			memcpy (dst + out, src + in, run);
+			in += run;
+			out += run;
+		} else {
+			size_t run = (c & 0x7f) + LZ_MIN_MATCH;
+			size_t offset = src[in] | src[in + 1] << 8;
+
+			in += 2;
+			ASSERT (offset > 0 && offset <= out && out + run <= PGSIZE);
+			/* Byte by byte: the source may overlap the output. */
+			for (; run > 0; run--, out++)
+				dst[out] = dst[out - offset];
+		}
+	}
+	ASSERT (out == PGSIZE);
+}